@@ -0,0 +1,133 @@
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// Benchmark for string interning under adversarial keys.
+///
+/// An attacker who knows the hash function can choose keys that all land in
+/// the same bucket. This program generates such keys against the hash used
+/// with a fixed seed of 0, then interns them with the fixed seed and with a
+/// random seed and reports how long lookups probe in vm.strings.
+
+#define KEY_COUNT 2000
+#define COLLISION_MASK 0xfffu
+#define LOOKUP_ROUNDS 20
+#define KEY_LENGTH 16
+
+static char keys[KEY_COUNT][KEY_LENGTH];
+
+static double now_ns() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1e9 + time.tv_nsec;
+}
+
+/// Finds KEY_COUNT keys whose hashes agree in the low bits with the current
+/// seed, which is what an attacker can do against a fixed hash function.
+static void generate_colliding_keys() {
+  size_t found = 0;
+  for (uint64_t candidate = 0; found < KEY_COUNT; ++candidate) {
+    char key[KEY_LENGTH];
+    int length = snprintf(key, sizeof(key), "k%llx",
+                          (unsigned long long)candidate);
+    if ((hash_string(key, length) & COLLISION_MASK) == 0) {
+      memcpy(keys[found++], key, length + 1);
+    }
+  }
+}
+
+/// Counts the buckets a lookup of key visits in one array of the intern set.
+///
+/// Returns:
+///   The number of buckets visited, or 0 if the key is not in the array.
+static size_t probes_in(uint32_t *hashes, ObjString **keys, size_t capacity,
+                        ObjString *key) {
+  size_t index = key->hash & (capacity - 1);
+  for (size_t probes = 1; probes <= capacity; ++probes) {
+    if (keys[index] == key) {
+      return probes;
+    }
+    if (hashes[index] == 0) {
+      return 0;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+  return 0;
+}
+
+static size_t probe_length(InternSet *set, ObjString *key) {
+  size_t probes = probes_in(set->hashes, set->keys, set->capacity, key);
+  if (probes == 0 && set->old_keys != NULL) {
+    probes = probes_in(set->old_hashes, set->old_keys, set->old_capacity, key);
+  }
+  return probes;
+}
+
+/// Grows the value stack of a fresh VM to hold count values. run() keeps the
+/// keys there so that the GC does not free them, and push() does not grow the
+/// stack by itself.
+static void reserve_stack(size_t count) {
+  if (vm.stack_capacity < count) {
+    vm.stack = GROW_ARRAY(Value, vm.stack, vm.stack_capacity, count);
+    vm.stack_capacity = count;
+    vm.stack_top = vm.stack;
+  }
+}
+
+/// Interns every key in a fresh VM and prints probe and timing statistics.
+static void run(const char *label) {
+  init_VM();
+  reserve_stack(KEY_COUNT);
+  ObjString *strings[KEY_COUNT];
+  double start = now_ns();
+  for (size_t i = 0; i < KEY_COUNT; ++i) {
+    strings[i] = copy_string(keys[i], strlen(keys[i]), false);
+    push(OBJ_VAL(strings[i]));
+  }
+  double intern_ns = now_ns() - start;
+
+  start = now_ns();
+  for (size_t round = 0; round < LOOKUP_ROUNDS; ++round) {
+    for (size_t i = 0; i < KEY_COUNT; ++i) {
+      copy_string(keys[i], strlen(keys[i]), false);
+    }
+  }
+  double lookup_ns = (now_ns() - start) / (LOOKUP_ROUNDS * KEY_COUNT);
+
+  size_t total = 0;
+  size_t longest = 0;
+  for (size_t i = 0; i < KEY_COUNT; ++i) {
+    size_t probes = probe_length(&vm.strings, strings[i]);
+    total += probes;
+    longest = probes > longest ? probes : longest;
+  }
+  printf("%-14s %12.1f %12zu %14.1f %14.1f\n", label,
+         (double)total / KEY_COUNT, longest, intern_ns / 1e6, lookup_ns);
+  free_VM();
+}
+
+int main() {
+  setenv("SALMON_HASH_SEED", "0", 1);
+  init_VM();
+  generate_colliding_keys();
+  free_VM();
+
+#ifdef KEYED_HASH
+  printf("hash: SipHash-1-3\n");
+#else
+  printf("hash: seeded FNV-1a\n");
+#endif /* ifdef KEYED_HASH */
+  printf("%d keys colliding in the low 12 bits with seed 0\n\n", KEY_COUNT);
+  printf("%-14s %12s %12s %14s %14s\n", "seed", "mean probes", "max probes",
+         "intern (ms)", "lookup (ns)");
+  run("fixed (0)");
+  unsetenv("SALMON_HASH_SEED");
+  run("random");
+  return EXIT_SUCCESS;
+}
@@ -1,8 +1,11 @@
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "value.h"
 #include "vm.h"
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 
 /// Initialize a Chunk structure.
 void init_chunk(Chunk *chunk) {
@@ -10,7 +13,30 @@ void init_chunk(Chunk *chunk) {
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->line_count = 0;
+  chunk->line_capacity = 0;
+  chunk->last_line = 0;
   init_value_array(&chunk->constants);
+  chunk->path_count = 0;
+  chunk->path_capacity = 0;
+  chunk->paths = NULL;
+  chunk->handler_count = 0;
+  chunk->handler_capacity = 0;
+  chunk->handlers = NULL;
+  chunk->switch_count = 0;
+  chunk->switch_capacity = 0;
+  chunk->switches = NULL;
+}
+/// Append a run of length bytes to the line table of a Chunk.
+static void write_line_run(Chunk *chunk, int8_t delta, uint8_t length) {
+  if (chunk->line_capacity < chunk->line_count + 2) {
+    size_t old_capacity = chunk->line_capacity;
+    chunk->line_capacity = GROW_CAPACITY(old_capacity);
+    chunk->lines =
+        GROW_ARRAY(uint8_t, chunk->lines, old_capacity, chunk->line_capacity);
+  }
+  chunk->lines[chunk->line_count++] = (uint8_t)delta;
+  chunk->lines[chunk->line_count++] = length;
 }
 /// Write a byte and its corresponding line number to a Chunk.
 void write_chunk(Chunk *chunk, uint8_t byte, size_t line) {
@@ -19,22 +45,79 @@ void write_chunk(Chunk *chunk, uint8_t byte, size_t line) {
     chunk->capacity = GROW_CAPACITY(old_capacity);
     chunk->code =
         GROW_ARRAY(uint8_t, chunk->code, old_capacity, chunk->capacity);
-    chunk->lines =
-        GROW_ARRAY(size_t, chunk->lines, old_capacity, chunk->capacity);
   }
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
   chunk->count++;
+
+  if (chunk->line_count > 0 && line == chunk->last_line &&
+      chunk->lines[chunk->line_count - 1] < UINT8_MAX) {
+    chunk->lines[chunk->line_count - 1]++;
+    return;
+  }
+  ptrdiff_t delta = (ptrdiff_t)line - (ptrdiff_t)chunk->last_line;
+  while (delta > INT8_MAX || delta < INT8_MIN) {
+    int8_t step = delta > 0 ? INT8_MAX : INT8_MIN;
+    write_line_run(chunk, step, 0);
+    delta -= step;
+  }
+  write_line_run(chunk, (int8_t)delta, 1);
+  chunk->last_line = line;
+}
+
+/// Get the line number of the byte at offset in a Chunk.
+size_t chunk_line(Chunk *chunk, size_t offset) {
+  size_t line = 0;
+  size_t end = 0;
+  for (size_t i = 0; i < chunk->line_count; i += 2) {
+    line += (int8_t)chunk->lines[i];
+    end += chunk->lines[i + 1];
+    if (offset < end) {
+      break;
+    }
+  }
+  return line;
 }
 
 /// Free the memory allocated for a Chunk.
 void free_chunk(Chunk *chunk) {
   FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(size_t, chunk->lines, chunk->capacity);
+  FREE_ARRAY(uint8_t, chunk->lines, chunk->line_capacity);
   free_value_array(&chunk->constants);
+  FREE_ARRAY(SourcePath, chunk->paths, chunk->path_capacity);
+  FREE_ARRAY(ExceptionHandler, chunk->handlers, chunk->handler_capacity);
+  for (size_t i = 0; i < chunk->switch_count; ++i) {
+    SwitchTable *table = &chunk->switches[i];
+    FREE_ARRAY(size_t, table->jumps, table->jump_count);
+    free_table(&table->strings);
+    FREE_ARRAY(SwitchCase, table->cases, table->case_capacity);
+  }
+  FREE_ARRAY(SwitchTable, chunk->switches, chunk->switch_capacity);
   init_chunk(chunk);
 }
 
+/// Shrink the arrays of a Chunk that is done being written to their contents.
+void trim_chunk(Chunk *chunk) {
+  chunk->code = GROW_ARRAY(uint8_t, chunk->code, chunk->capacity, chunk->count);
+  chunk->capacity = chunk->count;
+  chunk->lines = GROW_ARRAY(uint8_t, chunk->lines, chunk->line_capacity,
+                            chunk->line_count);
+  chunk->line_capacity = chunk->line_count;
+  ValueArray *constants = &chunk->constants;
+  constants->value = GROW_ARRAY(Value, constants->value, constants->capacity,
+                                constants->count);
+  constants->capacity = constants->count;
+  chunk->paths = GROW_ARRAY(SourcePath, chunk->paths, chunk->path_capacity,
+                            chunk->path_count);
+  chunk->path_capacity = chunk->path_count;
+  chunk->handlers =
+      GROW_ARRAY(ExceptionHandler, chunk->handlers, chunk->handler_capacity,
+                 chunk->handler_count);
+  chunk->handler_capacity = chunk->handler_count;
+  chunk->switches = GROW_ARRAY(SwitchTable, chunk->switches,
+                               chunk->switch_capacity, chunk->switch_count);
+  chunk->switch_capacity = chunk->switch_count;
+}
+
 /// Add a constant value to a Chunk and return its index.
 size_t add_constant(Chunk *chunk, Value value) {
   push(value);
@@ -42,3 +125,402 @@ size_t add_constant(Chunk *chunk, Value value) {
   pop();
   return chunk->constants.count - 1;
 }
+
+/// Record that the code written to a Chunk from now on comes from path.
+void add_path(Chunk *chunk, Value path) {
+  if (chunk->path_capacity < chunk->path_count + 1) {
+    size_t old_capacity = chunk->path_capacity;
+    chunk->path_capacity = GROW_CAPACITY(old_capacity);
+    push(path);
+    chunk->paths = GROW_ARRAY(SourcePath, chunk->paths, old_capacity,
+                              chunk->path_capacity);
+    pop();
+  }
+  chunk->paths[chunk->path_count].offset = chunk->count;
+  chunk->paths[chunk->path_count].path = path;
+  chunk->path_count++;
+}
+
+/// Get the source file of the code at offset, or nil if it is unknown.
+Value chunk_path(Chunk *chunk, size_t offset) {
+  Value path = NIL_VAL;
+  for (size_t i = 0; i < chunk->path_count; ++i) {
+    if (chunk->paths[i].offset > offset) {
+      break;
+    }
+    path = chunk->paths[i].path;
+  }
+  return path;
+}
+
+/// Add an entry to the exception table of a Chunk.
+void add_handler(Chunk *chunk, ExceptionHandler handler) {
+  if (chunk->handler_capacity < chunk->handler_count + 1) {
+    size_t old_capacity = chunk->handler_capacity;
+    chunk->handler_capacity = GROW_CAPACITY(old_capacity);
+    chunk->handlers = GROW_ARRAY(ExceptionHandler, chunk->handlers,
+                                 old_capacity, chunk->handler_capacity);
+  }
+  chunk->handlers[chunk->handler_count++] = handler;
+}
+
+/// Get the innermost handler protecting the code at offset, or NULL.
+ExceptionHandler *chunk_handler(Chunk *chunk, size_t offset) {
+  for (size_t i = 0; i < chunk->handler_count; ++i) {
+    ExceptionHandler *handler = &chunk->handlers[i];
+    if (handler->start <= offset && offset < handler->end) {
+      return handler;
+    }
+  }
+  return NULL;
+}
+
+/// Add an empty switch table to a Chunk and return its index.
+size_t add_switch(Chunk *chunk) {
+  if (chunk->switch_capacity < chunk->switch_count + 1) {
+    size_t old_capacity = chunk->switch_capacity;
+    chunk->switch_capacity = GROW_CAPACITY(old_capacity);
+    chunk->switches = GROW_ARRAY(SwitchTable, chunk->switches, old_capacity,
+                                 chunk->switch_capacity);
+  }
+  SwitchTable *table = &chunk->switches[chunk->switch_count];
+  table->low = 0;
+  table->jump_count = 0;
+  table->jumps = NULL;
+  init_table(&table->strings);
+  table->case_count = 0;
+  table->case_capacity = 0;
+  table->cases = NULL;
+  table->default_target = 0;
+  return chunk->switch_count++;
+}
+
+/// Add a case to a switch table, jumping to target when the value switched on
+/// equals value.
+///
+/// Returns:
+///   false if the table already has a case for value.
+bool add_switch_case(SwitchTable *table, Value value, size_t target) {
+  if (IS_STRING(value)) {
+    push(value);
+    bool is_new =
+        table_set(&table->strings, AS_STRING(value), INT_VAL((int32_t)target));
+    pop();
+    return is_new;
+  }
+  for (size_t i = 0; i < table->case_count; ++i) {
+    if (values_equal(table->cases[i].value, value)) {
+      return false;
+    }
+  }
+  if (table->case_capacity < table->case_count + 1) {
+    size_t old_capacity = table->case_capacity;
+    table->case_capacity = GROW_CAPACITY(old_capacity);
+    push(value);
+    table->cases = GROW_ARRAY(SwitchCase, table->cases, old_capacity,
+                              table->case_capacity);
+    pop();
+  }
+  table->cases[table->case_count].value = value;
+  table->cases[table->case_count].target = target;
+  table->case_count++;
+  return true;
+}
+
+static int compare_ints(const void *a, const void *b) {
+  int32_t x = *(const int32_t *)a;
+  int32_t y = *(const int32_t *)b;
+  return (x > y) - (x < y);
+}
+
+/// Move the integer cases of a finished switch table into its jump table.
+/// The table covers the largest run of cases that fills at least half of
+/// its range, and its gaps jump to the default target. Cases outside of it
+/// are left to be compared one by one.
+void build_jump_table(SwitchTable *table) {
+  size_t count = 0;
+  for (size_t i = 0; i < table->case_count; ++i) {
+    if (IS_INT(table->cases[i].value)) {
+      count++;
+    }
+  }
+  if (count == 0) {
+    return;
+  }
+  int32_t *values = ALLOCATE(int32_t, count);
+  count = 0;
+  for (size_t i = 0; i < table->case_count; ++i) {
+    if (IS_INT(table->cases[i].value)) {
+      values[count++] = AS_INT(table->cases[i].value);
+    }
+  }
+  qsort(values, count, sizeof(int32_t), compare_ints);
+  size_t best_start = 0;
+  size_t best_count = 0;
+  for (size_t i = 0; i < count; ++i) {
+    for (size_t j = i + best_count; j < count; ++j) {
+      if ((uint64_t)((int64_t)values[j] - values[i]) < 2 * (j - i + 1)) {
+        best_start = i;
+        best_count = j - i + 1;
+      }
+    }
+  }
+  int32_t low = values[best_start];
+  int32_t high = values[best_start + best_count - 1];
+  FREE_ARRAY(int32_t, values, count);
+
+  table->low = low;
+  table->jump_count = (size_t)((int64_t)high - low + 1);
+  table->jumps = ALLOCATE(size_t, table->jump_count);
+  for (size_t i = 0; i < table->jump_count; ++i) {
+    table->jumps[i] = table->default_target;
+  }
+  size_t remaining = 0;
+  for (size_t i = 0; i < table->case_count; ++i) {
+    SwitchCase *switch_case = &table->cases[i];
+    if (IS_INT(switch_case->value) && AS_INT(switch_case->value) >= low &&
+        AS_INT(switch_case->value) <= high) {
+      table->jumps[AS_INT(switch_case->value) - low] = switch_case->target;
+    } else {
+      table->cases[remaining++] = *switch_case;
+    }
+  }
+  table->case_count = remaining;
+}
+
+/// Get the constant index operand of the instruction at offset. It takes one
+/// byte, or two in the _LONG forms.
+size_t constant_operand(Chunk *chunk, size_t offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_GET_PROPERTY_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE_LONG:
+  case OP_TAIL_INVOKE_LONG:
+  case OP_SUPER_TAIL_INVOKE_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+  case OP_PRIVATE_METHOD_LONG:
+    return (size_t)chunk->code[offset + 1] << 8 | chunk->code[offset + 2];
+  default:
+    return chunk->code[offset + 1];
+  }
+}
+
+/// Get the number of bytes taken by the instruction at offset, including its
+/// operands. A superinstruction covers the whole sequence it replaced.
+size_t instruction_length(Chunk *chunk, size_t offset) {
+  switch (chunk->code[offset]) {
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+  case OP_RETURN_VALUES:
+  case OP_UNPACK:
+  case OP_TUPLE:
+  case OP_CALL:
+  case OP_TAIL_CALL:
+  case OP_CALL_CLOSURE:
+  case OP_CONSTANT:
+  case OP_GET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_GET_SUPER:
+  case OP_CLASS:
+  case OP_METHOD:
+  case OP_PRIVATE_METHOD:
+    return 2;
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_CLASS_LONG:
+  case OP_METHOD_LONG:
+  case OP_PRIVATE_METHOD_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_SET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+  case OP_SET_UPVALUE_LONG:
+  case OP_GET_FLAT_UPVALUE_LONG:
+    return 3;
+  case OP_GET_PROPERTY_LONG:
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE_LONG:
+  case OP_TAIL_INVOKE_LONG:
+  case OP_SUPER_TAIL_INVOKE_LONG:
+    return 4;
+  case OP_GET_PROPERTY:
+  case OP_GET_FIELD:
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+  case OP_LOOP:
+  case OP_SWITCH:
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_SUPER_TAIL_INVOKE:
+    return 3;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    size_t constant = constant_operand(chunk, offset);
+    ObjFunction *function = AS_FUNCTION(chunk->constants.value[constant]);
+    size_t length = chunk->code[offset] == OP_CLOSURE_LONG ? 3 : 2;
+    size_t captures = function->upvalue_count + function->flat_upvalue_count;
+    for (size_t i = 0; i < captures; ++i) {
+      length += chunk->code[offset + length] & CAPTURE_LONG ? 3 : 2;
+    }
+    return length;
+  }
+  case OP_INCREMENT_LOCAL:
+  case OP_ASSIGN_ADD_LOCALS:
+  case OP_ASSIGN_SUBTRACT_LOCALS:
+  case OP_ASSIGN_MULTIPLY_LOCALS:
+  case OP_ASSIGN_DIVIDE_LOCALS:
+  case OP_ASSIGN_ADD_LOCAL_CONSTANT:
+  case OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT:
+  case OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT:
+  case OP_ASSIGN_DIVIDE_LOCAL_CONSTANT:
+    return 8;
+  case OP_COPY_LOCAL:
+  case OP_SET_LOCAL_CONSTANT:
+    return 5;
+  case OP_FORPREP:
+    return 6;
+  case OP_FORLOOP:
+    return 7;
+  case OP_JUMP_IF_NOT_GREATER_LOCALS:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+  case OP_JUMP_IF_NOT_LESS_LOCALS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+  case OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT:
+  case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+  case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT:
+    return 7;
+  case OP_ADD_LOCALS:
+  case OP_SUBTRACT_LOCALS:
+  case OP_MULTIPLY_LOCALS:
+  case OP_DIVIDE_LOCALS:
+  case OP_GREATER_LOCALS:
+  case OP_LESS_LOCALS:
+  case OP_ADD_LOCAL_CONSTANT:
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+  case OP_MULTIPLY_LOCAL_CONSTANT:
+  case OP_DIVIDE_LOCAL_CONSTANT:
+  case OP_GREATER_LOCAL_CONSTANT:
+  case OP_LESS_LOCAL_CONSTANT:
+    return 5;
+  default:
+    return 1;
+  }
+}
+
+/// Gets how many values the instruction at offset leaves on the stack minus
+/// how many it takes off. Only the instructions the compiler emits are
+/// covered; the peephole pass and quickening never make code use more of
+/// the stack than the instructions they replace.
+int stack_effect(Chunk *chunk, size_t offset) {
+  switch (chunk->code[offset]) {
+  case OP_CONSTANT:
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE:
+  case OP_GET_LOCAL:
+  case OP_GET_GLOBAL:
+  case OP_GET_UPVALUE:
+  case OP_GET_FLAT_UPVALUE:
+  case OP_CLOSURE:
+  case OP_CLASS:
+  case OP_CONSTANT_LONG:
+  case OP_GET_GLOBAL_LONG:
+  case OP_CLOSURE_LONG:
+  case OP_CLASS_LONG:
+  case OP_GET_LOCAL_LONG:
+  case OP_GET_UPVALUE_LONG:
+  case OP_GET_FLAT_UPVALUE_LONG:
+    return 1;
+  case OP_POP:
+  case OP_DEFINE_GLOBAL:
+  case OP_SET_PROPERTY:
+  case OP_GET_ELEMENT:
+  case OP_SET_ELEMENT:
+  case OP_GET_SUPER:
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_NOT_EQUAL:
+  case OP_GREATER_EQUAL:
+  case OP_LESS_EQUAL:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE:
+  case OP_MODULO:
+  case OP_FLOOR_DIVIDE:
+  case OP_BIT_XOR:
+  case OP_SHIFT_LEFT:
+  case OP_SHIFT_RIGHT:
+  case OP_INHERIT:
+  case OP_CLOSE_UPVALUE:
+  case OP_THROW:
+  case OP_SWITCH:
+  case OP_RETURN:
+  case OP_RETURN_INITIALIZER:
+  case OP_METHOD:
+  case OP_PRIVATE_METHOD:
+  case OP_DEFINE_GLOBAL_LONG:
+  case OP_SET_PROPERTY_LONG:
+  case OP_GET_SUPER_LONG:
+  case OP_METHOD_LONG:
+  case OP_PRIVATE_METHOD_LONG:
+    return -1;
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+    return -2;
+  case OP_CALL:
+  case OP_TAIL_CALL:
+    // The callee and its arguments are replaced by the result.
+    return -chunk->code[offset + 1];
+  case OP_INVOKE:
+  case OP_SUPER_INVOKE:
+  case OP_TAIL_INVOKE:
+  case OP_SUPER_TAIL_INVOKE:
+    // The same, after popping whether the receiver is `this` or the
+    // superclass.
+    return -chunk->code[offset + 2] - 1;
+  case OP_INVOKE_LONG:
+  case OP_SUPER_INVOKE_LONG:
+  case OP_TAIL_INVOKE_LONG:
+  case OP_SUPER_TAIL_INVOKE_LONG:
+    return -chunk->code[offset + 3] - 1;
+  case OP_RETURN_VALUES:
+    return -chunk->code[offset + 1];
+  case OP_UNPACK:
+    // The value of the expression before it becomes one for each variable.
+    return chunk->code[offset + 1] - 1;
+  case OP_TUPLE:
+    return 1 - chunk->code[offset + 1];
+  default:
+    return 0;
+  }
+}
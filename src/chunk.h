@@ -1,10 +1,10 @@
 #pragma once
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 typedef enum Op_Code {
   OP_CONSTANT,
-  OP_PATH,
   OP_NIL,
   OP_TRUE,
   OP_FALSE,
@@ -16,6 +16,7 @@ typedef enum Op_Code {
   OP_SET_GLOBAL,
   OP_GET_UPVALUE,
   OP_SET_UPVALUE,
+  OP_GET_FLAT_UPVALUE,
   OP_GET_PROPERTY,
   OP_SET_PROPERTY,
   OP_GET_ELEMENT,
@@ -24,36 +25,225 @@ typedef enum Op_Code {
   OP_EQUAL,
   OP_GREATER,
   OP_LESS,
+  OP_NOT_EQUAL,
+  OP_GREATER_EQUAL,
+  OP_LESS_EQUAL,
   OP_ADD,
   OP_SUBTRACT,
   OP_MULTIPLY,
   OP_DIVIDE,
+  OP_MODULO,
+  OP_FLOOR_DIVIDE,
+  OP_BIT_XOR,
+  OP_SHIFT_LEFT,
+  OP_SHIFT_RIGHT,
   OP_NOT,
   OP_NEGATE,
   OP_JUMP,
   OP_JUMP_IF_FALSE,
+  // Compare-and-jump instructions pop both operands and jump if the
+  // comparison is false.
+  OP_JUMP_IF_NOT_EQUAL,
+  OP_JUMP_IF_EQUAL,
+  OP_JUMP_IF_NOT_GREATER,
+  OP_JUMP_IF_NOT_GREATER_EQUAL,
+  OP_JUMP_IF_NOT_LESS,
+  OP_JUMP_IF_NOT_LESS_EQUAL,
   OP_LOOP,
+  // Numeric for loops. Both take the counter slot, the limit and the flags
+  // below, OP_FORLOOP also the constant step, and end with a jump offset.
+  OP_FORPREP,
+  OP_FORLOOP,
   OP_CALL,
+  // CALL in tail position, always followed by a RETURN.
+  OP_TAIL_CALL,
   OP_INHERIT,
   OP_INVOKE,
   OP_SUPER_INVOKE,
+  // INVOKE and SUPER_INVOKE in tail position, always followed by a RETURN.
+  OP_TAIL_INVOKE,
+  OP_SUPER_TAIL_INVOKE,
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
+  OP_THROW,
+  OP_SWITCH,
+  OP_RETURN_VALUES,
+  OP_UNPACK,
+  OP_TUPLE,
   OP_RETURN,
+  // RETURN at the end of an initializer, which also records how many fields
+  // the instance ended up with.
+  OP_RETURN_INITIALIZER,
   OP_CLASS,
   OP_METHOD,
-  OP_PRIVATE_METHOD
+  OP_PRIVATE_METHOD,
+  // Forms of the instructions above whose constant index takes two bytes,
+  // for chunks with more than 256 constants.
+  OP_CONSTANT_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  OP_GET_PROPERTY_LONG,
+  OP_SET_PROPERTY_LONG,
+  OP_GET_SUPER_LONG,
+  OP_INVOKE_LONG,
+  OP_SUPER_INVOKE_LONG,
+  OP_TAIL_INVOKE_LONG,
+  OP_SUPER_TAIL_INVOKE_LONG,
+  OP_CLOSURE_LONG,
+  OP_CLASS_LONG,
+  OP_METHOD_LONG,
+  OP_PRIVATE_METHOD_LONG,
+  // Forms of the local and upvalue instructions whose slot takes two bytes,
+  // for functions with more than 256 locals or upvalues.
+  OP_GET_LOCAL_LONG,
+  OP_SET_LOCAL_LONG,
+  OP_GET_UPVALUE_LONG,
+  OP_SET_UPVALUE_LONG,
+  OP_GET_FLAT_UPVALUE_LONG,
+  // Superinstructions written by the peephole pass over the first opcode of
+  // the sequence they replace. The rest of the sequence is left in place, so
+  // jumps into the middle of it still land on valid instructions.
+  OP_INCREMENT_LOCAL,          // GET_LOCAL CONSTANT ADD SET_LOCAL POP
+  OP_ADD_LOCALS,               // GET_LOCAL GET_LOCAL ADD
+  OP_SUBTRACT_LOCALS,          // GET_LOCAL GET_LOCAL SUBTRACT
+  OP_MULTIPLY_LOCALS,          // GET_LOCAL GET_LOCAL MULTIPLY
+  OP_DIVIDE_LOCALS,            // GET_LOCAL GET_LOCAL DIVIDE
+  OP_GREATER_LOCALS,           // GET_LOCAL GET_LOCAL GREATER
+  OP_LESS_LOCALS,              // GET_LOCAL GET_LOCAL LESS
+  OP_ADD_LOCAL_CONSTANT,       // GET_LOCAL CONSTANT ADD
+  OP_SUBTRACT_LOCAL_CONSTANT,  // GET_LOCAL CONSTANT SUBTRACT
+  OP_MULTIPLY_LOCAL_CONSTANT,  // GET_LOCAL CONSTANT MULTIPLY
+  OP_DIVIDE_LOCAL_CONSTANT,    // GET_LOCAL CONSTANT DIVIDE
+  OP_GREATER_LOCAL_CONSTANT,   // GET_LOCAL CONSTANT GREATER
+  OP_LESS_LOCAL_CONSTANT,      // GET_LOCAL CONSTANT LESS
+  // GET_LOCAL GET_LOCAL and GET_LOCAL CONSTANT followed by a numeric
+  // compare-and-jump.
+  OP_JUMP_IF_NOT_GREATER_LOCALS,
+  OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS,
+  OP_JUMP_IF_NOT_LESS_LOCALS,
+  OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS,
+  OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT,
+  OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT,
+  OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT,
+  OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT,
+  // Superinstructions for a whole statement that assigns a local from locals
+  // and constants, fused when FUSE_ASSIGNMENTS is defined. Each covers the
+  // GET_LOCAL or CONSTANT operands, the operation, SET_LOCAL and POP.
+  OP_COPY_LOCAL,                     // a := b;
+  OP_SET_LOCAL_CONSTANT,             // a := 1;
+  OP_ASSIGN_ADD_LOCALS,              // a := b + c;
+  OP_ASSIGN_SUBTRACT_LOCALS,         // a := b - c;
+  OP_ASSIGN_MULTIPLY_LOCALS,         // a := b * c;
+  OP_ASSIGN_DIVIDE_LOCALS,           // a := b / c;
+  OP_ASSIGN_ADD_LOCAL_CONSTANT,      // a := b + 1;
+  OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT, // a := b - 1;
+  OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT, // a := b * 2;
+  OP_ASSIGN_DIVIDE_LOCAL_CONSTANT,   // a := b / 2;
+  // Specialized forms the VM rewrites a generic instruction to, in the code
+  // it decodes from a chunk, once it has seen its operand types. Each one
+  // turns back into the generic form when its guard fails.
+  OP_ADD_NUM,           // ADD of two numbers
+  OP_ADD_STR,           // ADD of two strings
+  OP_GET_FIELD,         // GET_PROPERTY of a field in a known bucket
+  OP_CALL_CLOSURE,      // CALL of a closure
+  OP_GET_ELEMENT_ARRAY  // GET_ELEMENT of an array at a number
 } Op_Code;
 
+// Flags in the first byte of each variable OP_CLOSURE captures. A local
+// capture takes a slot of the enclosing function rather than one of its
+// upvalues, and a long capture has a two-byte index.
+#define CAPTURE_LOCAL 1
+#define CAPTURE_LONG 2
+
+// The flags operand of OP_FORPREP and OP_FORLOOP. The low bits hold the
+// comparison of the counter against the limit.
+#define FOR_LESS 0
+#define FOR_LESS_EQUAL 1
+#define FOR_GREATER 2
+#define FOR_GREATER_EQUAL 3
+#define FOR_COMPARISON_MASK 3
+// The limit operand is a constant rather than a local slot.
+#define FOR_LIMIT_CONSTANT 4
+
+/// Marks the code of a chunk from offset on as coming from the source file
+/// path. A script merged from imported files switches paths part way through.
+typedef struct {
+  size_t offset;
+  Value path;
+} SourcePath;
+
+/// Code from start up to end that is protected by the catch block at handler.
+/// A throw in it unwinds the stack to the depth slots of the frame that were
+/// in use when the try block was entered, then pushes the thrown value for
+/// the catch variable.
+typedef struct {
+  size_t start;
+  size_t end;
+  size_t handler;
+  size_t depth;
+} ExceptionHandler;
+
+/// A case of a switch statement that is compared with the value switched on.
+typedef struct {
+  Value value;
+  size_t target;
+} SwitchCase;
+
+/// Where OP_SWITCH jumps to for each case of a switch statement, as offsets
+/// into the code. Dense integer cases index a jump table from low, string
+/// cases are hashed on their interned string, and any other cases are
+/// compared one by one.
+typedef struct {
+  int32_t low;
+  size_t jump_count;
+  size_t *jumps;
+  Table strings; ///< Targets as integers.
+  size_t case_count;
+  size_t case_capacity;
+  SwitchCase *cases;
+  size_t default_target;
+} SwitchTable;
+
 typedef struct Chunk {
   size_t count;
   size_t capacity;
   uint8_t *code;
-  size_t *lines;
+  // Runs of code bytes on the same line, two bytes each: the change in line
+  // number from the previous run as an int8_t, then the number of bytes in
+  // the run. Changes too large for a byte are split over empty runs.
+  uint8_t *lines;
+  size_t line_count;
+  size_t line_capacity;
+  // The line of the last run.
+  size_t last_line;
   ValueArray constants;
+  size_t path_count;
+  size_t path_capacity;
+  SourcePath *paths;
+  // Ordered so that a handler comes before the handlers of the try blocks
+  // around it.
+  size_t handler_count;
+  size_t handler_capacity;
+  ExceptionHandler *handlers;
+  size_t switch_count;
+  size_t switch_capacity;
+  SwitchTable *switches;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
 void write_chunk(Chunk *chunk, uint8_t byte, size_t line);
 void free_chunk(Chunk *chunk);
+void trim_chunk(Chunk *chunk);
+size_t chunk_line(Chunk *chunk, size_t offset);
 size_t add_constant(Chunk *chunk, Value value);
+void add_path(Chunk *chunk, Value path);
+Value chunk_path(Chunk *chunk, size_t offset);
+void add_handler(Chunk *chunk, ExceptionHandler handler);
+ExceptionHandler *chunk_handler(Chunk *chunk, size_t offset);
+size_t add_switch(Chunk *chunk);
+bool add_switch_case(SwitchTable *table, Value value, size_t target);
+void build_jump_table(SwitchTable *table);
+size_t constant_operand(Chunk *chunk, size_t offset);
+size_t instruction_length(Chunk *chunk, size_t offset);
+int stack_effect(Chunk *chunk, size_t offset);
@@ -5,10 +5,26 @@
 #include <stdint.h>
 
 #define NAN_BOXING
+#define _KEYED_HASH
+#define COMPUTED_GOTO
+#define FUSE_ASSIGNMENTS
 #define DEBUG_PRINT_CODE
 #define _DEBUG_TRACE_EXECUTION
+#define _DEBUG_OPCODE_PAIRS
 
 #define _DEBUG_STRESS_GC
 #define _DEBUG_LOG_GC
 
 #define UINT8_COUNT (UINT8_MAX + 1)
+#define UINT16_COUNT (UINT16_MAX + 1)
+
+// Keeps a rarely taken slow path from being inlined into the hot code that
+// calls it. LIKELY marks the condition of the fast path, so that the compiler
+// lays it out without taken branches.
+#ifdef __GNUC__
+#define NOINLINE __attribute__((noinline))
+#define LIKELY(condition) __builtin_expect(!!(condition), 1)
+#else
+#define NOINLINE
+#define LIKELY(condition) (condition)
+#endif /* ifdef __GNUC__ */
@@ -3,8 +3,10 @@
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
+#include "peephole.h"
 #include "scanner.h"
 #include "value.h"
+#include "vm.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +30,8 @@ typedef enum Precedence {
   PREC_AND,
   PREC_EQUALITY,
   PREC_COMPARISON,
+  PREC_BIT_XOR,
+  PREC_SHIFT,
   PREC_TERM,
   PREC_FACTOR,
   PREC_UNARY,
@@ -47,10 +51,15 @@ typedef struct Local {
   Token name;
   ssize_t depth;
   bool is_captured;
+  // Where the scope of the local starts in the source. The first time the
+  // local is captured, its scope is scanned for assignments to it.
+  Scanner scope;
+  bool is_scanned;
+  bool is_reassigned;
 } Local;
 
 typedef struct Upvalue {
-  uint8_t index;
+  uint16_t index;
   bool is_local;
 } Upvalue;
 
@@ -68,10 +77,27 @@ typedef struct Compiler {
   ObjFunction *function;
   FunctionType type;
 
-  Local locals[UINT8_COUNT];
+  // Locals and upvalues grow as they are added, up to UINT16_COUNT each.
+  Local *locals;
   size_t local_count;
-  Upvalue upvalues[UINT8_COUNT];
+  size_t local_capacity;
+  Upvalue *upvalues;
+  size_t upvalue_capacity;
+  Upvalue *flat_upvalues;
+  size_t flat_upvalue_capacity;
   size_t scope_depth;
+  // Offset of the last comparison emitted, and the furthest offset a patched
+  // jump lands on. A condition ending in a comparison that no jump lands
+  // after can be compiled into a compare-and-jump.
+  size_t last_comparison;
+  size_t last_jump_target;
+  // Offset of the last OP_CALL, OP_INVOKE or OP_SUPER_INVOKE emitted, which
+  // return_statement turns into its tail form if it ends the returned
+  // expression.
+  size_t last_call;
+  // Number of try blocks around the code being compiled. Calls in them are
+  // never made tail calls, which would run the callee outside the try block.
+  size_t try_depth;
 } Compiler;
 
 typedef struct ClassCompiler {
@@ -190,24 +216,98 @@ static size_t emit_jump(uint8_t instruction) {
 static void emit_return() {
   if (current->type == TYPE_INITIALIZER) {
     emit_bytes(OP_GET_LOCAL, 0);
+    emit_byte(OP_RETURN_INITIALIZER);
   } else {
     emit_byte(OP_NIL);
+    emit_byte(OP_RETURN);
   }
-  emit_byte(OP_RETURN);
 }
 
-static uint8_t make_constant(Value value) {
-  int constant = add_constant(current_chunk(), value);
-  if (constant > UINT8_MAX) {
+static size_t make_constant(Value value) {
+  size_t constant = add_constant(current_chunk(), value);
+  if (constant > UINT16_MAX) {
     error("Too many constants in one chunk.");
     return 0;
   }
 
-  return (uint8_t)constant;
+  return constant;
+}
+
+/// Gets the form of an instruction with a constant or slot operand that takes
+/// a two-byte index.
+static uint8_t long_form(uint8_t instruction) {
+  switch (instruction) {
+  case OP_GET_LOCAL:
+    return OP_GET_LOCAL_LONG;
+  case OP_SET_LOCAL:
+    return OP_SET_LOCAL_LONG;
+  case OP_GET_UPVALUE:
+    return OP_GET_UPVALUE_LONG;
+  case OP_SET_UPVALUE:
+    return OP_SET_UPVALUE_LONG;
+  case OP_GET_FLAT_UPVALUE:
+    return OP_GET_FLAT_UPVALUE_LONG;
+  case OP_CONSTANT:
+    return OP_CONSTANT_LONG;
+  case OP_GET_GLOBAL:
+    return OP_GET_GLOBAL_LONG;
+  case OP_DEFINE_GLOBAL:
+    return OP_DEFINE_GLOBAL_LONG;
+  case OP_SET_GLOBAL:
+    return OP_SET_GLOBAL_LONG;
+  case OP_GET_PROPERTY:
+    return OP_GET_PROPERTY_LONG;
+  case OP_SET_PROPERTY:
+    return OP_SET_PROPERTY_LONG;
+  case OP_GET_SUPER:
+    return OP_GET_SUPER_LONG;
+  case OP_INVOKE:
+    return OP_INVOKE_LONG;
+  case OP_SUPER_INVOKE:
+    return OP_SUPER_INVOKE_LONG;
+  case OP_CLOSURE:
+    return OP_CLOSURE_LONG;
+  case OP_CLASS:
+    return OP_CLASS_LONG;
+  case OP_METHOD:
+    return OP_METHOD_LONG;
+  case OP_PRIVATE_METHOD:
+    return OP_PRIVATE_METHOD_LONG;
+  default:
+    error("Too many constants in one chunk.");
+    return instruction;
+  }
+}
+
+/// Gets the form of a call instruction that reuses the caller's frame.
+static uint8_t tail_form(uint8_t instruction) {
+  switch (instruction) {
+  case OP_INVOKE:
+    return OP_TAIL_INVOKE;
+  case OP_SUPER_INVOKE:
+    return OP_SUPER_TAIL_INVOKE;
+  case OP_INVOKE_LONG:
+    return OP_TAIL_INVOKE_LONG;
+  case OP_SUPER_INVOKE_LONG:
+    return OP_SUPER_TAIL_INVOKE_LONG;
+  default:
+    return OP_TAIL_CALL;
+  }
+}
+
+/// Emits an instruction with a one-byte operand, or its _LONG form if the
+/// operand is a constant index or a slot that does not fit in a byte.
+static void emit_operand(uint8_t instruction, size_t operand) {
+  if (operand <= UINT8_MAX) {
+    emit_bytes(instruction, (uint8_t)operand);
+    return;
+  }
+  emit_byte(long_form(instruction));
+  emit_bytes((operand >> 8) & 0xff, operand & 0xff);
 }
 
 static void emit_constant(Value value) {
-  emit_bytes(OP_CONSTANT, make_constant(value));
+  emit_operand(OP_CONSTANT, make_constant(value));
 }
 
 static void patch_jump(size_t offset) {
@@ -218,24 +318,104 @@ static void patch_jump(size_t offset) {
 
   current_chunk()->code[offset] = (jump >> 8) & 0xff;
   current_chunk()->code[offset + 1] = jump & 0xff;
+  current->last_jump_target = current_chunk()->count;
+}
+
+static void emit_comparison(uint8_t instruction) {
+  emit_byte(instruction);
+  current->last_comparison = current_chunk()->count - 1;
+}
+
+/// Emits the jump taken when the condition that was just compiled is false.
+/// If the condition ends in a comparison, and no jump lands right after it,
+/// the comparison is rewritten into a compare-and-jump that pops both
+/// operands, so neither branch has to pop the condition.
+///
+/// Parameters:
+///   popped: Set to whether the jump consumes the condition.
+///
+/// Returns:
+///   The offset of the jump, for patch_jump.
+static size_t emit_condition_jump(bool *popped) {
+  Chunk *chunk = current_chunk();
+  *popped = false;
+  if (chunk->count == 0 || current->last_comparison != chunk->count - 1 ||
+      current->last_jump_target == chunk->count) {
+    return emit_jump(OP_JUMP_IF_FALSE);
+  }
+  uint8_t *comparison = &chunk->code[chunk->count - 1];
+  switch (*comparison) {
+  case OP_EQUAL:
+    *comparison = OP_JUMP_IF_NOT_EQUAL;
+    break;
+  case OP_NOT_EQUAL:
+    *comparison = OP_JUMP_IF_EQUAL;
+    break;
+  case OP_GREATER:
+    *comparison = OP_JUMP_IF_NOT_GREATER;
+    break;
+  case OP_GREATER_EQUAL:
+    *comparison = OP_JUMP_IF_NOT_GREATER_EQUAL;
+    break;
+  case OP_LESS:
+    *comparison = OP_JUMP_IF_NOT_LESS;
+    break;
+  case OP_LESS_EQUAL:
+    *comparison = OP_JUMP_IF_NOT_LESS_EQUAL;
+    break;
+  default:
+    return emit_jump(OP_JUMP_IF_FALSE);
+  }
+  current->last_comparison = SIZE_MAX;
+  *popped = true;
+  emit_byte(0xff);
+  emit_byte(0xff);
+  return chunk->count - 2;
+}
+
+/// Takes the next local slot of the current function, growing the array of
+/// locals when it is full.
+static Local *push_local() {
+  if (current->local_count == current->local_capacity) {
+    size_t old_capacity = current->local_capacity;
+    current->local_capacity = GROW_CAPACITY(old_capacity);
+    current->locals = GROW_ARRAY(Local, current->locals, old_capacity,
+                                 current->local_capacity);
+  }
+  return &current->locals[current->local_count++];
 }
 
 static void init_compiler(Compiler *compiler, FunctionType type) {
   compiler->enclosing = current;
   compiler->function = NULL;
   compiler->type = type;
+  compiler->locals = NULL;
   compiler->local_count = 0;
+  compiler->local_capacity = 0;
+  compiler->upvalues = NULL;
+  compiler->upvalue_capacity = 0;
+  compiler->flat_upvalues = NULL;
+  compiler->flat_upvalue_capacity = 0;
   compiler->function = new_function();
   compiler->scope_depth = 0;
+  compiler->last_comparison = SIZE_MAX;
+  compiler->last_jump_target = SIZE_MAX;
+  compiler->last_call = SIZE_MAX;
+  compiler->try_depth = 0;
   current = compiler;
   if (type != TYPE_SCRIPT) {
     current->function->name =
         copy_string(parser.previous.start, parser.previous.length, false);
+    // Functions are reported as coming from the file they are declared in.
+    Chunk *enclosing = &compiler->enclosing->function->chunk;
+    add_path(current_chunk(), chunk_path(enclosing, enclosing->count));
   }
 
-  Local *local = &current->locals[current->local_count++];
+  Local *local = push_local();
   local->depth = 0;
   local->is_captured = false;
+  local->is_scanned = true;
+  local->is_reassigned = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -245,9 +425,64 @@ static void init_compiler(Compiler *compiler, FunctionType type) {
   }
 }
 
+/// Computes the most stack slots a function uses at once by walking its code
+/// and tracking the stack depth. Statements leave the stack as they found
+/// it, so the depth carries on past unconditional jumps and returns, and only
+/// forward jumps need to carry their depth to where they land.
+static size_t max_stack_depth(Chunk *chunk, size_t arity) {
+  size_t *landing = ALLOCATE_ZEROED(size_t, chunk->count + 1);
+  // A catch block starts with the thrown value pushed above its try block's
+  // locals.
+  for (size_t i = 0; i < chunk->handler_count; ++i) {
+    ExceptionHandler *handler = &chunk->handlers[i];
+    landing[handler->handler] = handler->depth + 1;
+  }
+  // The function itself and its parameters.
+  size_t depth = arity + 1;
+  size_t max = depth;
+  for (size_t offset = 0; offset < chunk->count;
+       offset += instruction_length(chunk, offset)) {
+    if (landing[offset] > depth) {
+      depth = landing[offset];
+    }
+    depth += stack_effect(chunk, offset);
+    if (depth > max) {
+      max = depth;
+    }
+    switch (chunk->code[offset]) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+    case OP_FORPREP: {
+      size_t length = instruction_length(chunk, offset);
+      uint8_t *jump = &chunk->code[offset + length - 2];
+      size_t target = offset + length + (size_t)(jump[0] << 8 | jump[1]);
+      if (target <= chunk->count && landing[target] < depth) {
+        landing[target] = depth;
+      }
+      break;
+    }
+    default:
+      break;
+    }
+  }
+  FREE_ARRAY(size_t, landing, chunk->count + 1);
+  return max;
+}
+
 static ObjFunction *end_compiler() {
   emit_return();
   ObjFunction *function = current->function;
+  if (!parser.had_error) {
+    function->max_stack = max_stack_depth(current_chunk(), function->arity);
+    optimize_chunk(current_chunk());
+  }
+  trim_chunk(current_chunk());
 #ifdef DEBUG_PRINT_CODE
   if (!parser.had_error) {
     disassemble_chunk(current_chunk(), function->name != NULL
@@ -263,6 +498,15 @@ static ObjFunction *end_compiler() {
   return function;
 }
 
+/// Frees the locals and upvalues of a compiler once its closure has been
+/// emitted.
+static void free_compiler(Compiler *compiler) {
+  FREE_ARRAY(Local, compiler->locals, compiler->local_capacity);
+  FREE_ARRAY(Upvalue, compiler->upvalues, compiler->upvalue_capacity);
+  FREE_ARRAY(Upvalue, compiler->flat_upvalues,
+             compiler->flat_upvalue_capacity);
+}
+
 static void begin_scope() { current->scope_depth++; }
 
 static void end_scope() {
@@ -286,8 +530,10 @@ static ParseRule *get_rule(TokenType type);
 static void parse_precedence(Precedence precedence);
 static Token synthetic_token(const char *text);
 
-static uint8_t identifier_constant(Token *name) {
-  return make_constant(OBJ_VAL(copy_string(name->start, name->length, false)));
+static size_t identifier_constant(Token *name) {
+  ObjString *string = copy_string(name->start, name->length, false);
+  symbol_for(string);
+  return make_constant(OBJ_VAL(string));
 }
 
 static bool identifiers_equal(Token *a, Token *b) {
@@ -310,52 +556,137 @@ static int resolve_local(Compiler *compiler, Token *name) {
   return -1;
 }
 
-static ssize_t add_upvalue(Compiler *compiler, uint8_t index, bool is_local) {
-  ssize_t upvalue_count = compiler->function->upvalue_count;
-  for (size_t i = 0; i < upvalue_count; ++i) {
-    Upvalue *upvalue = &compiler->upvalues[i];
+/// Gets the position of the current token, for scanning from it later.
+static Scanner current_position() {
+  Scanner position;
+  position.start = parser.current.start;
+  position.current = parser.current.start;
+  position.line = parser.current.line;
+  return position;
+}
+
+static bool is_assignment(TokenType type) {
+  return type == TOKEN_EQUAL || type == TOKEN_PLUS_EQUAL ||
+         type == TOKEN_MINUS_EQUAL || type == TOKEN_STAR_EQUAL ||
+         type == TOKEN_SLASH_EQUAL;
+}
+
+/// Tells whether a local may be assigned anywhere in its scope, by scanning
+/// for its name followed by an assignment. Element assignments like
+/// `name[i] := value` store the array back into the variable, so they count
+/// too. The scan only looks at tokens, so a property or a shadowing variable
+/// of the same name is taken for the local, which only costs it a flat
+/// capture.
+static bool is_reassigned(Local *local) {
+  if (local->is_scanned) {
+    return local->is_reassigned;
+  }
+  Scanner saved = save_scanner();
+  restore_scanner(local->scope);
+  size_t depth = 0;
+  size_t brackets = 0;
+  bool after_name = false;
+  local->is_reassigned = false;
+  for (;;) {
+    Token token = scan_token();
+    if (token.type == TOKEN_EOF ||
+        (token.type == TOKEN_RIGHT_BRACE && depth-- == 0)) {
+      break;
+    }
+    if (token.type == TOKEN_LEFT_BRACE) {
+      depth++;
+    }
+    if (brackets > 0) {
+      if (token.type == TOKEN_LEFT_BRACKET) {
+        brackets++;
+      } else if (token.type == TOKEN_RIGHT_BRACKET) {
+        brackets--;
+      }
+      continue;
+    }
+    if (after_name && is_assignment(token.type)) {
+      local->is_reassigned = true;
+      break;
+    }
+    if (after_name && token.type == TOKEN_LEFT_BRACKET) {
+      brackets = 1;
+      continue;
+    }
+    after_name = token.type == TOKEN_IDENTIFIER &&
+                 identifiers_equal(&token, &local->name);
+  }
+  restore_scanner(saved);
+  local->is_scanned = true;
+  return local->is_reassigned;
+}
+
+static ssize_t add_upvalue(Compiler *compiler, uint16_t index, bool is_local,
+                           bool is_flat) {
+  Upvalue **upvalues = is_flat ? &compiler->flat_upvalues : &compiler->upvalues;
+  size_t *capacity = is_flat ? &compiler->flat_upvalue_capacity
+                             : &compiler->upvalue_capacity;
+  size_t *upvalue_count = is_flat ? &compiler->function->flat_upvalue_count
+                                  : &compiler->function->upvalue_count;
+  for (size_t i = 0; i < *upvalue_count; ++i) {
+    Upvalue *upvalue = &(*upvalues)[i];
     if (upvalue->index == index && upvalue->is_local == is_local) {
       return i;
     }
   }
 
-  if (upvalue_count == UINT8_COUNT) {
+  if (*upvalue_count == UINT16_COUNT) {
     error("Too many closure vairables in function");
     return 0;
   }
-  compiler->upvalues[upvalue_count].is_local = is_local;
-  compiler->upvalues[upvalue_count].index = index;
-  return compiler->function->upvalue_count++;
+  if (*upvalue_count == *capacity) {
+    size_t old_capacity = *capacity;
+    *capacity = GROW_CAPACITY(old_capacity);
+    *upvalues = GROW_ARRAY(Upvalue, *upvalues, old_capacity, *capacity);
+  }
+  (*upvalues)[*upvalue_count].is_local = is_local;
+  (*upvalues)[*upvalue_count].index = index;
+  return (*upvalue_count)++;
 }
 
-static ssize_t resolve_upvalue(Compiler *compiler, Token *name) {
+/// Resolves a variable captured from an enclosing function. Variables that
+/// are never assigned are copied into the closure, and is_flat is set for
+/// them. The others are shared with the enclosing function through an
+/// upvalue.
+static ssize_t resolve_upvalue(Compiler *compiler, Token *name,
+                               bool *is_flat) {
   if (compiler->enclosing == NULL) {
     return -1;
   }
 
   ssize_t local = resolve_local(compiler->enclosing, name);
   if (local != -1) {
-    compiler->enclosing->locals[local].is_captured = true;
-    return add_upvalue(compiler, (uint8_t)local, true);
+    Local *captured = &compiler->enclosing->locals[local];
+    *is_flat = !is_reassigned(captured);
+    if (!*is_flat) {
+      captured->is_captured = true;
+    }
+    return add_upvalue(compiler, (uint16_t)local, true, *is_flat);
   }
 
-  ssize_t upvalue = resolve_upvalue(compiler->enclosing, name);
+  ssize_t upvalue = resolve_upvalue(compiler->enclosing, name, is_flat);
   if (upvalue != -1) {
-    return add_upvalue(compiler, (uint8_t)upvalue, false);
+    return add_upvalue(compiler, (uint16_t)upvalue, false, *is_flat);
   }
 
   return -1;
 }
 
 static void add_local(Token name) {
-  if (current->local_count == UINT8_COUNT) {
+  if (current->local_count == UINT16_COUNT) {
     error("Too many local variables in function.");
     return;
   }
-  Local *local = &current->locals[current->local_count++];
+  Local *local = push_local();
   local->name = name;
   local->depth = -1;
   local->is_captured = false;
+  local->scope = current_position();
+  local->is_scanned = false;
 }
 
 static void declare_variable() {
@@ -376,7 +707,7 @@ static void declare_variable() {
   add_local(*name);
 }
 
-static uint8_t parse_variable(const char *error_message) {
+static size_t parse_variable(const char *error_message) {
   consume(TOKEN_IDENTIFIER, error_message);
   declare_variable();
   if (current->scope_depth > 0) {
@@ -392,12 +723,12 @@ static void mark_initialized() {
   current->locals[current->local_count - 1].depth = current->scope_depth;
 }
 
-static void define_variable(uint8_t global) {
+static void define_variable(size_t global) {
   if (current->scope_depth > 0) {
     mark_initialized();
     return;
   }
-  emit_bytes(OP_DEFINE_GLOBAL, global);
+  emit_operand(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argument_list() {
@@ -428,22 +759,22 @@ static void binary(bool can_assign) {
   parse_precedence((Precedence)(rule->precedence + 1));
   switch (operator_type) {
   case TOKEN_BANG_EQUAL:
-    emit_bytes(OP_EQUAL, OP_NOT);
+    emit_comparison(OP_NOT_EQUAL);
     break;
   case TOKEN_EQUAL_EQUAL:
-    emit_byte(OP_EQUAL);
+    emit_comparison(OP_EQUAL);
     break;
   case TOKEN_GREATER:
-    emit_byte(OP_GREATER);
+    emit_comparison(OP_GREATER);
     break;
   case TOKEN_GREATER_EQUAL:
-    emit_bytes(OP_LESS, OP_NOT);
+    emit_comparison(OP_GREATER_EQUAL);
     break;
   case TOKEN_LESS:
-    emit_byte(OP_LESS);
+    emit_comparison(OP_LESS);
     break;
   case TOKEN_LESS_EQUAL:
-    emit_bytes(OP_GREATER, OP_NOT);
+    emit_comparison(OP_LESS_EQUAL);
     break;
   case TOKEN_PLUS:
     emit_byte(OP_ADD);
@@ -457,6 +788,21 @@ static void binary(bool can_assign) {
   case TOKEN_SLASH:
     emit_byte(OP_DIVIDE);
     break;
+  case TOKEN_PERCENT:
+    emit_byte(OP_MODULO);
+    break;
+  case TOKEN_BACKSLASH:
+    emit_byte(OP_FLOOR_DIVIDE);
+    break;
+  case TOKEN_CARET:
+    emit_byte(OP_BIT_XOR);
+    break;
+  case TOKEN_LESS_LESS:
+    emit_byte(OP_SHIFT_LEFT);
+    break;
+  case TOKEN_GREATER_GREATER:
+    emit_byte(OP_SHIFT_RIGHT);
+    break;
   default:
     return;
   }
@@ -466,12 +812,13 @@ static void call(bool can_assign) {
   uint8_t arg_count = argument_list();
   if (strncmp(parser.previous.start, "super", 5) == 0) {
     Token token = synthetic_token("init");
-    uint8_t init = identifier_constant(&token);
+    size_t init = identifier_constant(&token);
     emit_constant(FALSE_VAL);
-    emit_bytes(OP_SUPER_INVOKE, init);
+    emit_operand(OP_SUPER_INVOKE, init);
     emit_byte(arg_count);
   } else {
     emit_bytes(OP_CALL, arg_count);
+    current->last_call = current_chunk()->count - 2;
   }
 }
 
@@ -481,17 +828,20 @@ static void dot(bool can_assign) {
     this = true;
   }
   consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifier_constant(&parser.previous);
+  size_t name = identifier_constant(&parser.previous);
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_bytes(OP_SET_PROPERTY, name);
+    emit_operand(OP_SET_PROPERTY, name);
   } else if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
     emit_constant(this ? TRUE_VAL : FALSE_VAL);
-    emit_bytes(OP_INVOKE, name);
+    current->last_call = current_chunk()->count;
+    emit_operand(OP_INVOKE, name);
     emit_byte(arg_count);
   } else {
-    emit_bytes(OP_GET_PROPERTY, name);
+    emit_operand(OP_GET_PROPERTY, name);
+    // The field slot cached by OP_GET_FIELD, filled in at runtime.
+    emit_byte(0);
   }
 }
 
@@ -511,14 +861,39 @@ static void literal(bool can_assign) {
   }
 }
 
+/// Compiles a parenthesized expression, or a tuple if the parentheses hold
+/// a comma. A trailing comma is allowed, so `(x,)` is a tuple of one value
+/// and `()` is the empty tuple.
 static void grouping(bool can_assign) {
+  if (match(TOKEN_RIGHT_PAREN)) {
+    emit_byte(OP_TUPLE);
+    emit_byte(0);
+    return;
+  }
   expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+  if (!match(TOKEN_COMMA)) {
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression");
+    return;
+  }
+  size_t length = 1;
+  while (!check(TOKEN_RIGHT_PAREN)) {
+    expression();
+    if (length == UINT8_MAX) {
+      error("Can't have more than 255 elements in a tuple.");
+    }
+    length++;
+    if (!match(TOKEN_COMMA)) {
+      break;
+    }
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after tuple elements.");
+  emit_byte(OP_TUPLE);
+  emit_byte((uint8_t)length);
 }
 
 static void number(bool can_assign) {
   double value = strtod(parser.previous.start, NULL);
-  emit_constant(NUMBER_VAL(value));
+  emit_constant(double_to_value(value));
 }
 
 static void or_(bool can_assign) {
@@ -537,6 +912,46 @@ static void string(bool can_assign) {
 
 static void block();
 
+/// Emits the operands of OP_CLOSURE for one captured variable: its flags,
+/// then its index in one byte, or in two if it has CAPTURE_LONG set.
+static void emit_capture(Upvalue *upvalue) {
+  uint8_t flags = upvalue->is_local ? CAPTURE_LOCAL : 0;
+  if (upvalue->index <= UINT8_MAX) {
+    emit_bytes(flags, upvalue->index);
+    return;
+  }
+  emit_byte(flags | CAPTURE_LONG);
+  emit_bytes((upvalue->index >> 8) & 0xff, upvalue->index & 0xff);
+}
+
+/// Emits the code creating a closure over a function that was just compiled.
+/// A function that captures nothing gets a single closure, made here and
+/// loaded as a constant every time the function is evaluated.
+static void emit_closure(ObjFunction *function, Compiler *compiler) {
+  if (function->upvalue_count == 0 && function->flat_upvalue_count == 0) {
+    push(OBJ_VAL(function));
+    ObjClosure *closure = new_closure(function);
+    pop();
+    emit_constant(OBJ_VAL(closure));
+    return;
+  }
+  emit_operand(OP_CLOSURE, make_constant(OBJ_VAL(function)));
+  for (size_t i = 0; i < function->upvalue_count; ++i) {
+    emit_capture(&compiler->upvalues[i]);
+  }
+  for (size_t i = 0; i < function->flat_upvalue_count; ++i) {
+    emit_capture(&compiler->flat_upvalues[i]);
+  }
+}
+
+/// Starts the scopes of the parameters at the body of the function, so that
+/// scanning them for assignments stops at the end of the body.
+static void begin_body() {
+  for (size_t i = 1; i <= current->function->arity; ++i) {
+    current->locals[i].scope = current_position();
+  }
+}
+
 static void lambda(bool can_assign) {
   Compiler compiler;
   init_compiler(&compiler, TYPE_FUNCTION);
@@ -547,7 +962,7 @@ static void lambda(bool can_assign) {
       if (current->function->arity > 255) {
         error_at_current("Can't have more that 255 parameters.");
       }
-      uint8_t constant = parse_variable("Expect parameter name.");
+      size_t constant = parse_variable("Expect parameter name.");
       define_variable(constant);
     } while (match(TOKEN_COMMA));
   }
@@ -555,38 +970,38 @@ static void lambda(bool can_assign) {
   consume(TOKEN_EQUAL_EQUAL, "Expect '=>' after parameters.");
   consume(TOKEN_GREATER, "Expect '=>' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before lambda body.");
+  begin_body();
   block();
   ObjFunction *function = end_compiler();
-  emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
-
-  for (size_t i = 0; i < function->upvalue_count; ++i) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
-  }
+  emit_closure(function, &compiler);
+  free_compiler(&compiler);
 }
 
 static void set_named_array(Token name) {
   uint8_t set_op;
+  bool is_flat;
   int arg = resolve_local(current, &name);
   if (arg != -1) {
     set_op = OP_SET_LOCAL;
-  } else if ((arg = resolve_upvalue(current, &name)) != -1) {
+  } else if ((arg = resolve_upvalue(current, &name, &is_flat)) != -1) {
     set_op = OP_SET_UPVALUE;
   } else {
     arg = identifier_constant(&name);
     set_op = OP_SET_GLOBAL;
   }
-  emit_bytes(set_op, (uint8_t)arg);
+  emit_operand(set_op, arg);
 }
 
 static void named_variable(Token name, bool can_assign) {
   uint8_t get_op, set_op;
+  bool is_flat;
   int arg = resolve_local(current, &name);
   if (arg != -1) {
     get_op = OP_GET_LOCAL;
     set_op = OP_SET_LOCAL;
-  } else if ((arg = resolve_upvalue(current, &name)) != -1) {
-    get_op = OP_GET_UPVALUE;
+  } else if ((arg = resolve_upvalue(current, &name, &is_flat)) != -1) {
+    // A flat upvalue is never assigned, so set_op is never emitted for it.
+    get_op = is_flat ? OP_GET_FLAT_UPVALUE : OP_GET_UPVALUE;
     set_op = OP_SET_UPVALUE;
   } else {
     arg = identifier_constant(&name);
@@ -595,29 +1010,29 @@ static void named_variable(Token name, bool can_assign) {
   }
   if (can_assign && match(TOKEN_EQUAL)) {
     expression();
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_operand(set_op, arg);
   } else if (can_assign && match(TOKEN_PLUS_EQUAL)) {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_operand(get_op, arg);
     expression();
     emit_byte(OP_ADD);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_operand(set_op, arg);
   } else if (can_assign && match(TOKEN_MINUS_EQUAL)) {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_operand(get_op, arg);
     expression();
     emit_byte(OP_SUBTRACT);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_operand(set_op, arg);
   } else if (can_assign && match(TOKEN_STAR_EQUAL)) {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_operand(get_op, arg);
     expression();
     emit_byte(OP_MULTIPLY);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_operand(set_op, arg);
   } else if (can_assign && match(TOKEN_SLASH_EQUAL)) {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_operand(get_op, arg);
     expression();
     emit_byte(OP_DIVIDE);
-    emit_bytes(set_op, (uint8_t)arg);
+    emit_operand(set_op, arg);
   } else {
-    emit_bytes(get_op, (uint8_t)arg);
+    emit_operand(get_op, arg);
   }
 }
 
@@ -640,26 +1055,27 @@ static void super(bool can_assign) {
   }
   if (match(TOKEN_LEFT_PAREN)) {
     Token token = synthetic_token("init");
-    uint8_t init = identifier_constant(&token);
+    size_t init = identifier_constant(&token);
     named_variable(synthetic_token("this"), false);
     uint8_t arg_count = argument_list();
     named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_SUPER_INVOKE, init);
+    emit_operand(OP_SUPER_INVOKE, init);
     emit_byte(arg_count);
     return;
   }
   consume(TOKEN_DOT, "Expect '.' or '(' after 'super'.");
   consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
-  uint8_t name = identifier_constant(&parser.previous);
+  size_t name = identifier_constant(&parser.previous);
   named_variable(synthetic_token("this"), false);
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
     named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_SUPER_INVOKE, name);
+    current->last_call = current_chunk()->count;
+    emit_operand(OP_SUPER_INVOKE, name);
     emit_byte(arg_count);
   } else {
     named_variable(synthetic_token("super"), false);
-    emit_bytes(OP_GET_SUPER, name);
+    emit_operand(OP_GET_SUPER, name);
   }
 }
 
@@ -672,9 +1088,9 @@ static void this(bool can_assign) {
   if (match(TOKEN_LEFT_PAREN)) {
     uint8_t arg_count = argument_list();
     Token token = synthetic_token("init");
-    uint8_t init = identifier_constant(&token);
+    size_t init = identifier_constant(&token);
     emit_constant(TRUE_VAL);
-    emit_bytes(OP_INVOKE, init);
+    emit_operand(OP_INVOKE, init);
     emit_byte(arg_count);
   }
 }
@@ -740,6 +1156,9 @@ ParseRule rules[] = {
     [TOKEN_QUESTION] = {NULL, ternary, PREC_TERM},
     [TOKEN_SLASH] = {NULL, binary, PREC_FACTOR},
     [TOKEN_STAR] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_PERCENT] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_BACKSLASH] = {NULL, binary, PREC_FACTOR},
+    [TOKEN_CARET] = {NULL, binary, PREC_BIT_XOR},
     [TOKEN_BANG] = {unary, NULL, PREC_NONE},
     [TOKEN_BANG_EQUAL] = {NULL, binary, PREC_EQUALITY},
     [TOKEN_EQUAL] = {NULL, NULL, PREC_NONE},
@@ -750,11 +1169,16 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS] = {NULL, binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL] = {NULL, binary, PREC_COMPARISON},
+    [TOKEN_LESS_LESS] = {NULL, binary, PREC_SHIFT},
+    [TOKEN_GREATER_GREATER] = {NULL, binary, PREC_SHIFT},
     [TOKEN_IDENTIFIER] = {variable, NULL, PREC_NONE},
     [TOKEN_STRING] = {string, NULL, PREC_NONE},
     [TOKEN_NUMBER] = {number, NULL, PREC_NONE},
     [TOKEN_AND] = {NULL, and_, PREC_AND},
+    [TOKEN_CASE] = {NULL, NULL, PREC_NONE},
+    [TOKEN_CATCH] = {NULL, NULL, PREC_NONE},
     [TOKEN_CLASS] = {NULL, NULL, PREC_NONE},
+    [TOKEN_DEFAULT] = {NULL, NULL, PREC_NONE},
     [TOKEN_ELSE] = {NULL, NULL, PREC_NONE},
     [TOKEN_FALSE] = {literal, NULL, PREC_NONE},
     [TOKEN_FOR] = {NULL, NULL, PREC_NONE},
@@ -764,8 +1188,11 @@ ParseRule rules[] = {
     [TOKEN_OR] = {lambda, or_, PREC_OR},
     [TOKEN_RETURN] = {NULL, NULL, PREC_NONE},
     [TOKEN_SUPER] = {super, NULL, PREC_NONE},
+    [TOKEN_SWITCH] = {NULL, NULL, PREC_NONE},
     [TOKEN_THIS] = {this, NULL, PREC_NONE},
+    [TOKEN_THROW] = {NULL, NULL, PREC_NONE},
     [TOKEN_TRUE] = {literal, NULL, PREC_NONE},
+    [TOKEN_TRY] = {NULL, NULL, PREC_NONE},
     [TOKEN_VAR] = {NULL, NULL, PREC_NONE},
     [TOKEN_WHILE] = {NULL, NULL, PREC_NONE},
     [TOKEN_ERROR] = {NULL, NULL, PREC_NONE},
@@ -810,8 +1237,6 @@ static void function(FunctionType type) {
   init_compiler(&compiler, type);
   begin_scope();
   parser.last_line++;
-  emit_constant(OBJ_VAL(copy_string(parser.path, strlen(parser.path), false)));
-  emit_byte(OP_PATH);
 
   consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
   if (!check(TOKEN_RIGHT_PAREN)) {
@@ -820,20 +1245,17 @@ static void function(FunctionType type) {
       if (current->function->arity > 255) {
         error_at_current("Can't have more that 255 parameters.");
       }
-      uint8_t constant = parse_variable("Expect parameter name.");
+      size_t constant = parse_variable("Expect parameter name.");
       define_variable(constant);
     } while (match(TOKEN_COMMA));
   }
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
   consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  begin_body();
   block();
   ObjFunction *function = end_compiler();
-  emit_bytes(OP_CLOSURE, make_constant(OBJ_VAL(function)));
-
-  for (size_t i = 0; i < function->upvalue_count; ++i) {
-    emit_byte(compiler.upvalues[i].is_local ? 1 : 0);
-    emit_byte(compiler.upvalues[i].index);
-  }
+  emit_closure(function, &compiler);
+  free_compiler(&compiler);
 }
 
 static void method() {
@@ -842,7 +1264,7 @@ static void method() {
     private = true;
   }
   consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifier_constant(&parser.previous);
+  size_t constant = identifier_constant(&parser.previous);
   FunctionType type = TYPE_METHOD;
   if (parser.previous.length == 4 &&
       memcmp(parser.previous.start, "init", 4) == 0) {
@@ -850,18 +1272,18 @@ static void method() {
   }
   function(type);
   if (private) {
-    emit_bytes(OP_PRIVATE_METHOD, constant);
+    emit_operand(OP_PRIVATE_METHOD, constant);
   } else {
-    emit_bytes(OP_METHOD, constant);
+    emit_operand(OP_METHOD, constant);
   }
 }
 
 static void class_declaration() {
   consume(TOKEN_IDENTIFIER, "Expect class name.");
   Token class_name = parser.previous;
-  uint8_t name_constant = identifier_constant(&parser.previous);
+  size_t name_constant = identifier_constant(&parser.previous);
   declare_variable();
-  emit_bytes(OP_CLASS, name_constant);
+  emit_operand(OP_CLASS, name_constant);
   define_variable(name_constant);
   ClassCompiler class_compiler;
   class_compiler.has_superclass = false;
@@ -875,6 +1297,8 @@ static void class_declaration() {
     }
     begin_scope();
     add_local(synthetic_token("super"));
+    current->locals[current->local_count - 1].is_scanned = true;
+    current->locals[current->local_count - 1].is_reassigned = false;
     define_variable(0);
     named_variable(class_name, false);
     emit_byte(OP_INHERIT);
@@ -894,14 +1318,61 @@ static void class_declaration() {
 }
 
 static void fun_declaration() {
-  uint8_t global = parse_variable("Expect function name.");
+  size_t global = parse_variable("Expect function name.");
+  if (current->scope_depth > 0) {
+    // The closure is stored in the local only after it is made, so closures
+    // referring to the function itself must share it through an upvalue.
+    Local *local = &current->locals[current->local_count - 1];
+    local->is_scanned = true;
+    local->is_reassigned = true;
+  }
   mark_initialized();
   function(TYPE_FUNCTION);
   define_variable(global);
 }
 
+/// Compiles the rest of `var a, b := f();` once the first variable has been
+/// parsed. A function returning several values pads them with nil or drops
+/// the extra ones to match the operand of the OP_UNPACK after the call, and
+/// skips it. Any other expression leaves one value, which OP_UNPACK pads
+/// with nil.
+static void multiple_var_declaration(size_t first) {
+  size_t globals[UINT8_MAX];
+  size_t count = 0;
+  globals[count++] = first;
+  do {
+    size_t global = parse_variable("Expect variable name.");
+    if (count == UINT8_MAX) {
+      error("Can't declare more than 255 variables at once.");
+      continue;
+    }
+    globals[count++] = global;
+  } while (match(TOKEN_COMMA));
+  consume(TOKEN_EQUAL, "Expect ':=' after variable names.");
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  emit_byte(OP_UNPACK);
+  emit_byte((uint8_t)count);
+
+  if (current->scope_depth > 0) {
+    for (size_t i = 0; i < count; ++i) {
+      current->locals[current->local_count - count + i].depth =
+          current->scope_depth;
+    }
+    return;
+  }
+  // The last value is on top of the stack.
+  for (size_t i = count; i-- > 0;) {
+    emit_operand(OP_DEFINE_GLOBAL, globals[i]);
+  }
+}
+
 static void var_declaration() {
-  uint8_t gloabal = parse_variable("Expect variable name.");
+  size_t gloabal = parse_variable("Expect variable name.");
+  if (match(TOKEN_COMMA)) {
+    multiple_var_declaration(gloabal);
+    return;
+  }
   if (match(TOKEN_EQUAL)) {
     expression();
   } else {
@@ -917,22 +1388,214 @@ static void expression_statement() {
   emit_byte(OP_POP);
 }
 
+/// The clauses of a numeric for loop, `for (var i := a; i < b; i += s)`.
+typedef struct NumericFor {
+  Token counter;
+  TokenType comparison;
+  // Either an identifier naming a local or a number literal.
+  Token limit;
+  double limit_value;
+  double step;
+} NumericFor;
+
+/// Scans a number literal with an optional leading minus sign.
+static bool scan_signed_number(Token *token, double *value) {
+  bool negative = token->type == TOKEN_MINUS;
+  if (negative) {
+    *token = scan_token();
+  }
+  if (token->type != TOKEN_NUMBER) {
+    return false;
+  }
+  *value = strtod(token->start, NULL);
+  if (negative) {
+    *value = -*value;
+  }
+  return true;
+}
+
+static bool scan_counter(NumericFor *loop) {
+  Token token = scan_token();
+  return token.type == TOKEN_IDENTIFIER &&
+         identifiers_equal(&token, &loop->counter);
+}
+
+/// Skips the initializer of a for loop, which can be any expression, by
+/// tracking its nesting to find the semicolon that ends it.
+static bool skip_initializer() {
+  size_t depth = 0;
+  for (;;) {
+    Token token = scan_token();
+    switch (token.type) {
+    case TOKEN_LEFT_PAREN:
+    case TOKEN_LEFT_BRACE:
+    case TOKEN_LEFT_BRACKET:
+      depth++;
+      break;
+    case TOKEN_RIGHT_PAREN:
+    case TOKEN_RIGHT_BRACE:
+    case TOKEN_RIGHT_BRACKET:
+      if (depth == 0) {
+        return false;
+      }
+      depth--;
+      break;
+    case TOKEN_SEMICOLON:
+      if (depth == 0) {
+        return true;
+      }
+      break;
+    case TOKEN_EOF:
+    case TOKEN_ERROR:
+      return false;
+    default:
+      break;
+    }
+  }
+}
+
+static bool scan_numeric_clauses(NumericFor *loop) {
+  if (scan_token().type != TOKEN_EQUAL || !skip_initializer()) {
+    return false;
+  }
+  if (!scan_counter(loop)) {
+    return false;
+  }
+  loop->comparison = scan_token().type;
+  if (loop->comparison != TOKEN_LESS && loop->comparison != TOKEN_LESS_EQUAL &&
+      loop->comparison != TOKEN_GREATER &&
+      loop->comparison != TOKEN_GREATER_EQUAL) {
+    return false;
+  }
+  loop->limit = scan_token();
+  if (loop->limit.type != TOKEN_IDENTIFIER &&
+      !scan_signed_number(&loop->limit, &loop->limit_value)) {
+    return false;
+  }
+  if (scan_token().type != TOKEN_SEMICOLON || !scan_counter(loop)) {
+    return false;
+  }
+  TokenType increment = scan_token().type;
+  if (increment != TOKEN_PLUS_EQUAL && increment != TOKEN_MINUS_EQUAL) {
+    return false;
+  }
+  Token step = scan_token();
+  if (!scan_signed_number(&step, &loop->step)) {
+    return false;
+  }
+  if (increment == TOKEN_MINUS_EQUAL) {
+    loop->step = -loop->step;
+  }
+  return scan_token().type == TOKEN_RIGHT_PAREN;
+}
+
+/// Looks ahead from the counter of a for loop for the clauses of a numeric
+/// loop, whose limit is a local or a number and whose step is a number. The
+/// scanner is rewound afterwards, so the initializer is compiled as usual.
+static bool scan_numeric_for(NumericFor *loop) {
+  if (!check(TOKEN_IDENTIFIER)) {
+    return false;
+  }
+  loop->counter = parser.current;
+  Scanner saved = save_scanner();
+  bool numeric = scan_numeric_clauses(loop);
+  restore_scanner(saved);
+  return numeric;
+}
+
+/// Compiles a numeric for loop once its initializer has been compiled. The
+/// counter stays in its local slot, where the body can read and assign it.
+/// OP_FORPREP tests the condition once before the first iteration, and
+/// OP_FORLOOP steps the counter, tests it and branches back to the body in a
+/// single instruction.
+static void numeric_for_statement(NumericFor *loop) {
+  uint8_t counter = (uint8_t)resolve_local(current, &loop->counter);
+  uint8_t flags;
+  switch (loop->comparison) {
+  case TOKEN_LESS:
+    flags = FOR_LESS;
+    break;
+  case TOKEN_LESS_EQUAL:
+    flags = FOR_LESS_EQUAL;
+    break;
+  case TOKEN_GREATER:
+    flags = FOR_GREATER;
+    break;
+  default:
+    flags = FOR_GREATER_EQUAL;
+    break;
+  }
+  uint8_t limit;
+  if (loop->limit.type == TOKEN_IDENTIFIER) {
+    limit = (uint8_t)resolve_local(current, &loop->limit);
+  } else {
+    limit = (uint8_t)make_constant(double_to_value(loop->limit_value));
+    flags |= FOR_LIMIT_CONSTANT;
+  }
+  uint8_t step = (uint8_t)make_constant(double_to_value(loop->step));
+  // The clauses were already checked by scan_numeric_for.
+  while (!check(TOKEN_RIGHT_PAREN)) {
+    advance();
+  }
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+  emit_byte(OP_FORPREP);
+  emit_byte(counter);
+  emit_byte(limit);
+  emit_byte(flags);
+  size_t exit_jump = current_chunk()->count;
+  emit_byte(0xff);
+  emit_byte(0xff);
+  size_t body_start = current_chunk()->count;
+  statement();
+  emit_byte(OP_FORLOOP);
+  emit_byte(counter);
+  emit_byte(limit);
+  emit_byte(step);
+  emit_byte(flags);
+  size_t offset = current_chunk()->count - body_start + 2;
+  if (offset > UINT16_MAX) {
+    error("Loop body too large.");
+  }
+  emit_byte((offset >> 8) & 0xff);
+  emit_byte(offset & 0xff);
+  patch_jump(exit_jump);
+}
+
 static void for_statement() {
   begin_scope();
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
   if (match(TOKEN_SEMICOLON)) {
   } else if (match(TOKEN_VAR)) {
+    NumericFor loop;
+    bool numeric = scan_numeric_for(&loop);
     var_declaration();
+    // The limit and step constants of OP_FORLOOP take a byte each, and so
+    // do the slots of the counter and of a local limit, which comes before
+    // the counter.
+    if (current_chunk()->constants.count + 2 > UINT8_COUNT ||
+        current->local_count > UINT8_COUNT) {
+      numeric = false;
+    }
+    if (numeric && (loop.limit.type != TOKEN_IDENTIFIER ||
+                    resolve_local(current, &loop.limit) != -1)) {
+      numeric_for_statement(&loop);
+      end_scope();
+      return;
+    }
   } else {
     expression_statement();
   }
   size_t loop_start = current_chunk()->count;
   ssize_t exit_jump = -1;
+  bool popped = false;
   if (!match(TOKEN_SEMICOLON)) {
     expression();
     consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-    exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-    emit_byte(OP_POP);
+    exit_jump = emit_condition_jump(&popped);
+    if (!popped) {
+      emit_byte(OP_POP);
+    }
   }
   if (!match(TOKEN_RIGHT_PAREN)) {
     size_t body_jump = emit_jump(OP_JUMP);
@@ -948,7 +1611,9 @@ static void for_statement() {
   emit_loop(loop_start);
   if (exit_jump != -1) {
     patch_jump(exit_jump);
-    emit_byte(OP_POP);
+    if (!popped) {
+      emit_byte(OP_POP);
+    }
   }
   end_scope();
 }
@@ -957,12 +1622,17 @@ static void if_statement() {
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.)");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  size_t then_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  bool popped;
+  size_t then_jump = emit_condition_jump(&popped);
+  if (!popped) {
+    emit_byte(OP_POP);
+  }
   statement();
   size_t else_jump = emit_jump(OP_JUMP);
   patch_jump(then_jump);
-  emit_byte(OP_POP);
+  if (!popped) {
+    emit_byte(OP_POP);
+  }
   if (match(TOKEN_ELSE)) {
     statement();
   }
@@ -981,31 +1651,188 @@ static void return_statement() {
       error("Can't return a value from an initializer.");
     }
     expression();
+    size_t count = 1;
+    while (match(TOKEN_COMMA)) {
+      expression();
+      if (count == UINT8_MAX) {
+        error("Can't return more than 255 values.");
+      }
+      count++;
+    }
     consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+    if (count > 1) {
+      emit_byte(OP_RETURN_VALUES);
+      emit_byte((uint8_t)count);
+      return;
+    }
+    Chunk *chunk = current_chunk();
+    if (current->last_call != SIZE_MAX &&
+        current->last_call + instruction_length(chunk, current->last_call) ==
+            chunk->count &&
+        current->try_depth == 0) {
+      chunk->code[current->last_call] =
+          tail_form(chunk->code[current->last_call]);
+    }
     emit_byte(OP_RETURN);
   }
 }
 
+/// Parses the value of a case label, which must be a literal.
+static Value case_value() {
+  bool negative = match(TOKEN_MINUS);
+  if (match(TOKEN_NUMBER)) {
+    double value = strtod(parser.previous.start, NULL);
+    return double_to_value(negative ? -value : value);
+  }
+  if (!negative && match(TOKEN_STRING)) {
+    return OBJ_VAL(copy_string(parser.previous.start + 1,
+                               parser.previous.length - 2, true));
+  }
+  if (!negative && match(TOKEN_TRUE)) {
+    return TRUE_VAL;
+  }
+  if (!negative && match(TOKEN_FALSE)) {
+    return FALSE_VAL;
+  }
+  if (!negative && match(TOKEN_NIL)) {
+    return NIL_VAL;
+  }
+  error_at_current("Expect a number, string, boolean or nil as case value.");
+  return NIL_VAL;
+}
+
+/// Compiles a switch statement. The value switched on is popped by
+/// OP_SWITCH, which jumps straight to its case through the switch table of
+/// the chunk. Each case runs in its own scope and then jumps past the rest,
+/// and without a default case OP_SWITCH jumps past them all.
+static void switch_statement() {
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'switch'.");
+  expression();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after value.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' before switch cases.");
+  size_t table = add_switch(current_chunk());
+  if (table > UINT16_MAX) {
+    error("Too many switch statements in one function.");
+  }
+  emit_byte(OP_SWITCH);
+  emit_byte((table >> 8) & 0xff);
+  emit_byte(table & 0xff);
+
+  size_t *exits = NULL;
+  size_t exit_count = 0;
+  size_t exit_capacity = 0;
+  bool has_default = false;
+  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+    size_t target = current_chunk()->count;
+    if (match(TOKEN_CASE)) {
+      do {
+        Value value = case_value();
+        if (!add_switch_case(&current_chunk()->switches[table], value,
+                             target)) {
+          error("Duplicate case value.");
+        }
+      } while (match(TOKEN_COMMA));
+    } else if (match(TOKEN_DEFAULT)) {
+      if (has_default) {
+        error("A switch can only have one default case.");
+      }
+      has_default = true;
+      current_chunk()->switches[table].default_target = target;
+    } else {
+      error_at_current("Expect 'case' or 'default'.");
+      break;
+    }
+    consume(TOKEN_COLON, "Expect ':' after case.");
+    current->last_jump_target = target;
+    begin_scope();
+    while (!check(TOKEN_CASE) && !check(TOKEN_DEFAULT) &&
+           !check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
+      declaration();
+    }
+    end_scope();
+    if (exit_capacity < exit_count + 1) {
+      size_t old_capacity = exit_capacity;
+      exit_capacity = GROW_CAPACITY(old_capacity);
+      exits = GROW_ARRAY(size_t, exits, old_capacity, exit_capacity);
+    }
+    exits[exit_count++] = emit_jump(OP_JUMP);
+  }
+  consume(TOKEN_RIGHT_BRACE, "Expect '}' after switch cases.");
+
+  for (size_t i = 0; i < exit_count; ++i) {
+    patch_jump(exits[i]);
+  }
+  FREE_ARRAY(size_t, exits, exit_capacity);
+  SwitchTable *switch_table = &current_chunk()->switches[table];
+  if (!has_default) {
+    switch_table->default_target = current_chunk()->count;
+  }
+  build_jump_table(switch_table);
+}
+
+/// Compiles `try { ... } catch (name) { ... }`. Nothing is emitted on entry
+/// to the try block. Instead, its code is entered in the exception table of
+/// the chunk along with the catch block, which a throw unwinds to with the
+/// thrown value in the local name.
+static void try_statement() {
+  consume(TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+  ExceptionHandler handler;
+  handler.start = current_chunk()->count;
+  handler.depth = current->local_count;
+  current->try_depth++;
+  begin_scope();
+  block();
+  end_scope();
+  current->try_depth--;
+  handler.end = current_chunk()->count;
+  size_t exit_jump = emit_jump(OP_JUMP);
+  handler.handler = current_chunk()->count;
+  add_handler(current_chunk(), handler);
+
+  consume(TOKEN_CATCH, "Expect 'catch' after try block.");
+  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
+  begin_scope();
+  consume(TOKEN_IDENTIFIER, "Expect exception variable name.");
+  declare_variable();
+  mark_initialized();
+  consume(TOKEN_RIGHT_PAREN, "Expect ')' after exception variable.");
+  consume(TOKEN_LEFT_BRACE, "Expect '{' after catch clause.");
+  block();
+  end_scope();
+  patch_jump(exit_jump);
+}
+
+static void throw_statement() {
+  expression();
+  consume(TOKEN_SEMICOLON, "Expect ';' after thrown value.");
+  emit_byte(OP_THROW);
+}
+
 static void while_statement() {
   size_t loop_start = current_chunk()->count;
   consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
   expression();
   consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  size_t exit_jump = emit_jump(OP_JUMP_IF_FALSE);
-  emit_byte(OP_POP);
+  bool popped;
+  size_t exit_jump = emit_condition_jump(&popped);
+  if (!popped) {
+    emit_byte(OP_POP);
+  }
   statement();
   emit_loop(loop_start);
   patch_jump(exit_jump);
-  emit_byte(OP_POP);
+  if (!popped) {
+    emit_byte(OP_POP);
+  }
 }
 
 static void path_statement() {
   consume(TOKEN_FILE_PATH, "Expect path name.");
   parser.last_line = parser.previous.line;
   parser.path = substr(parser.previous.start, parser.previous.length);
-  emit_constant(
-      OBJ_VAL(copy_string(parser.path, parser.previous.length - 1, false)));
-  emit_byte(OP_PATH);
+  add_path(current_chunk(), OBJ_VAL(copy_string(parser.path,
+                                                parser.previous.length - 1,
+                                                false)));
 }
 
 static void synchronize() {
@@ -1021,6 +1848,9 @@ static void synchronize() {
     case TOKEN_IF:
     case TOKEN_WHILE:
     case TOKEN_RETURN:
+    case TOKEN_TRY:
+    case TOKEN_THROW:
+    case TOKEN_SWITCH:
       return;
     default:;
     }
@@ -1056,6 +1886,12 @@ static void statement() {
     if_statement();
   } else if (match(TOKEN_RETURN)) {
     return_statement();
+  } else if (match(TOKEN_SWITCH)) {
+    switch_statement();
+  } else if (match(TOKEN_TRY)) {
+    try_statement();
+  } else if (match(TOKEN_THROW)) {
+    throw_statement();
   } else if (match(TOKEN_PATH)) {
     path_statement();
   } else {
@@ -1076,6 +1912,7 @@ ObjFunction *compile(const char *source) {
     declaration();
   }
   ObjFunction *function = end_compiler();
+  free_compiler(&compiler);
   return parser.had_error ? NULL : function;
 }
 
@@ -12,6 +12,11 @@ void disassemble_chunk(Chunk *chunk, const char *name) {
   for (size_t offset = 0; offset < chunk->count;) {
     offset = disassemble_instruction(chunk, offset);
   }
+  for (size_t i = 0; i < chunk->handler_count; ++i) {
+    ExceptionHandler *handler = &chunk->handlers[i];
+    printf("try %04zu-%04zu catch %04zu depth %zu\n", handler->start,
+           handler->end, handler->handler, handler->depth);
+  }
 }
 
 static size_t simple_instruction(const char *name, int offset) {
@@ -25,46 +30,174 @@ static size_t byte_instruction(const char *name, Chunk *chunk, size_t offset) {
   return offset + 2;
 }
 
+static size_t short_instruction(const char *name, Chunk *chunk,
+                                size_t offset) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-16s %4d\n", name, slot);
+  return offset + 3;
+}
+
+/// Reads the index of a variable captured by OP_CLOSURE, moving offset past
+/// the capture.
+static size_t capture_index(Chunk *chunk, size_t *offset) {
+  uint8_t flags = chunk->code[(*offset)++];
+  if (!(flags & CAPTURE_LONG)) {
+    return chunk->code[(*offset)++];
+  }
+  size_t index = (size_t)chunk->code[*offset] << 8 | chunk->code[*offset + 1];
+  *offset += 2;
+  return index;
+}
+
 static size_t jump_instruction(const char *name, int sign, Chunk *chunk,
                                size_t offset) {
   uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
   jump |= chunk->code[offset + 2];
-  printf("%-16s %4zu -> %zu", name, offset, offset + 3 + sign * jump);
+  printf("%-16s %4zu -> %zu\n", name, offset, offset + 3 + sign * jump);
+  return offset + 3;
+}
+
+static size_t switch_instruction(const char *name, Chunk *chunk,
+                                 size_t offset) {
+  size_t index =
+      (size_t)(chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+  SwitchTable *table = &chunk->switches[index];
+  printf("%-16s %4zu default -> %zu\n", name, index, table->default_target);
+  for (size_t i = 0; i < table->jump_count; ++i) {
+    if (table->jumps[i] != table->default_target) {
+      printf("%04zu      |                     %lld -> %zu\n", offset,
+             (long long)table->low + (long long)i, table->jumps[i]);
+    }
+  }
+  for (size_t i = 0; i < table->strings.capacity; ++i) {
+    Entry *entry = &table->strings.entries[i];
+    if (entry->key != NULL) {
+      printf("%04zu      |                     '%s' -> %d\n", offset,
+             entry->key->chars, AS_INT(entry->value));
+    }
+  }
+  for (size_t i = 0; i < table->case_count; ++i) {
+    printf("%04zu      |                     ", offset);
+    print_value(table->cases[i].value);
+    printf(" -> %zu\n", table->cases[i].target);
+  }
   return offset + 3;
 }
 
 static size_t constant_instruction(const char *name, Chunk *chunk,
                                    size_t offset) {
-  uint8_t constant = chunk->code[offset + 1];
-  printf("%-16s %4d '", name, constant);
+  size_t constant = constant_operand(chunk, offset);
+  printf("%-16s %4zu '", name, constant);
   print_value(chunk->constants.value[constant]);
   printf("'\n");
-  return offset + 2;
+  return offset + instruction_length(chunk, offset);
+}
+
+static size_t local_constant_instruction(const char *name, Chunk *chunk,
+                                         size_t offset) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 3];
+  printf("%-16s %4d '", name, slot);
+  print_value(chunk->constants.value[constant]);
+  printf("'\n");
+  return offset + instruction_length(chunk, offset);
+}
+
+static size_t locals_instruction(const char *name, Chunk *chunk,
+                                 size_t offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 3];
+  printf("%-16s %4d %4d\n", name, a, b);
+  return offset + 5;
+}
+
+static size_t property_instruction(const char *name, Chunk *chunk,
+                                   size_t offset) {
+  size_t constant = constant_operand(chunk, offset);
+  size_t length = instruction_length(chunk, offset);
+  uint8_t slot = chunk->code[offset + length - 1];
+  printf("%-16s %4zu '", name, constant);
+  print_value(chunk->constants.value[constant]);
+  printf("' slot %d\n", slot);
+  return offset + length;
+}
+
+static size_t fused_jump_instruction(const char *name, Chunk *chunk,
+                                     size_t offset) {
+  uint8_t a = chunk->code[offset + 1];
+  uint8_t b = chunk->code[offset + 3];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 5] << 8);
+  jump |= chunk->code[offset + 6];
+  printf("%-16s %4d %4d -> %zu\n", name, a, b, offset + 7 + jump);
+  return offset + 7;
+}
+
+static size_t for_instruction(const char *name, Chunk *chunk, size_t offset) {
+  static const char *comparisons[] = {"<", "<=", ">", ">="};
+  bool is_loop = chunk->code[offset] == OP_FORLOOP;
+  size_t length = is_loop ? 7 : 6;
+  uint8_t counter = chunk->code[offset + 1];
+  uint8_t limit = chunk->code[offset + 2];
+  uint8_t flags = chunk->code[offset + length - 3];
+  uint16_t jump = (uint16_t)(chunk->code[offset + length - 2] << 8);
+  jump |= chunk->code[offset + length - 1];
+  printf("%-16s %4d %s ", name, counter,
+         comparisons[flags & FOR_COMPARISON_MASK]);
+  if (flags & FOR_LIMIT_CONSTANT) {
+    print_value(chunk->constants.value[limit]);
+  } else {
+    printf("%d", limit);
+  }
+  if (is_loop) {
+    printf(" step ");
+    print_value(chunk->constants.value[chunk->code[offset + 3]]);
+    printf(" -> %zu\n", offset + length - jump);
+  } else {
+    printf(" -> %zu\n", offset + length + jump);
+  }
+  return offset + length;
+}
+
+static size_t assign_instruction(const char *name, Chunk *chunk,
+                                 size_t offset) {
+  uint8_t destination = chunk->code[offset + 6];
+  uint8_t source = chunk->code[offset + 1];
+  uint8_t operand = chunk->code[offset + 3];
+  printf("%-16s %4d %4d %4d\n", name, destination, source, operand);
+  return offset + 8;
+}
+
+static size_t copy_instruction(const char *name, Chunk *chunk, size_t offset) {
+  uint8_t source = chunk->code[offset + 1];
+  uint8_t destination = chunk->code[offset + 3];
+  printf("%-16s %4d %4d\n", name, destination, source);
+  return offset + 5;
 }
 
 static size_t invoke_instruction(const char *name, Chunk *chunk,
                                  size_t offset) {
-  uint8_t constant = chunk->code[offset + 1];
-  uint8_t arg_count = chunk->code[offset + 2];
-  printf("%-16s (%d args) %d '", name, arg_count, constant);
+  size_t constant = constant_operand(chunk, offset);
+  size_t length = instruction_length(chunk, offset);
+  uint8_t arg_count = chunk->code[offset + length - 1];
+  printf("%-16s (%d args) %zu '", name, arg_count, constant);
   print_value(chunk->constants.value[constant]);
   printf("'\n");
-  return offset + 3;
+  return offset + length;
 }
 
 size_t disassemble_instruction(Chunk *chunk, size_t offset) {
   printf("%04zu ", offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  size_t line = chunk_line(chunk, offset);
+  if (offset > 0 && line == chunk_line(chunk, offset - 1)) {
     printf("   | ");
   } else {
-    printf("%4zu ", chunk->lines[offset]);
+    printf("%4zu ", line);
   }
 
   switch (chunk->code[offset]) {
   case OP_CONSTANT:
     return constant_instruction("OP_CONSTANT", chunk, offset);
-  case OP_PATH:
-    return simple_instruction("OP_PATH", offset);
   case OP_NIL:
     return simple_instruction("OP_NIL", offset);
   case OP_TRUE:
@@ -87,8 +220,10 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset) {
     return byte_instruction("OP_GET_UPVALUE", chunk, offset);
   case OP_SET_UPVALUE:
     return byte_instruction("OP_SET_UPVALUE", chunk, offset);
+  case OP_GET_FLAT_UPVALUE:
+    return byte_instruction("OP_GET_FLAT_UPVALUE", chunk, offset);
   case OP_GET_PROPERTY:
-    return constant_instruction("OP_GET_PROPERTY", chunk, offset);
+    return property_instruction("OP_GET_PROPERTY", chunk, offset);
   case OP_SET_PROPERTY:
     return constant_instruction("OP_SET_PROPERTY", chunk, offset);
   case OP_GET_SUPER:
@@ -103,6 +238,12 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset) {
     return simple_instruction("OP_GREATER", offset);
   case OP_LESS:
     return simple_instruction("OP_LESS", offset);
+  case OP_NOT_EQUAL:
+    return simple_instruction("OP_NOT_EQUAL", offset);
+  case OP_GREATER_EQUAL:
+    return simple_instruction("OP_GREATER_EQUAL", offset);
+  case OP_LESS_EQUAL:
+    return simple_instruction("OP_LESS_EQUAL", offset);
   case OP_ADD:
     return simple_instruction("OP_ADD", offset);
   case OP_SUBTRACT:
@@ -111,6 +252,16 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset) {
     return simple_instruction("OP_MULTIPLY", offset);
   case OP_DIVIDE:
     return simple_instruction("OP_DIVIDE", offset);
+  case OP_MODULO:
+    return simple_instruction("OP_MODULO", offset);
+  case OP_FLOOR_DIVIDE:
+    return simple_instruction("OP_FLOOR_DIVIDE", offset);
+  case OP_BIT_XOR:
+    return simple_instruction("OP_BIT_XOR", offset);
+  case OP_SHIFT_LEFT:
+    return simple_instruction("OP_SHIFT_LEFT", offset);
+  case OP_SHIFT_RIGHT:
+    return simple_instruction("OP_SHIFT_RIGHT", offset);
   case OP_NOT:
     return simple_instruction("OP_NOT", offset);
   case OP_NEGATE:
@@ -119,33 +270,78 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset) {
     return jump_instruction("OP_JUMP", 1, chunk, offset);
   case OP_JUMP_IF_FALSE:
     return jump_instruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_EQUAL:
+    return jump_instruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+  case OP_JUMP_IF_EQUAL:
+    return jump_instruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER:
+    return jump_instruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    return jump_instruction("OP_JUMP_IF_NOT_GREATER_EQUAL", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_LESS:
+    return jump_instruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+    return jump_instruction("OP_JUMP_IF_NOT_LESS_EQUAL", 1, chunk, offset);
   case OP_LOOP:
     return jump_instruction("OP_LOOP", -1, chunk, offset);
+  case OP_FORPREP:
+    return for_instruction("OP_FORPREP", chunk, offset);
+  case OP_FORLOOP:
+    return for_instruction("OP_FORLOOP", chunk, offset);
   case OP_CALL:
     return byte_instruction("OP_CALL", chunk, offset);
-  case OP_CLOSURE: {
-    offset++;
-    uint8_t constant = chunk->code[offset++];
-    printf("%-16s %4d ", "OP_CLOSURE", constant);
+  case OP_TAIL_CALL:
+    return byte_instruction("OP_TAIL_CALL", chunk, offset);
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    bool is_long = chunk->code[offset] == OP_CLOSURE_LONG;
+    size_t constant = constant_operand(chunk, offset);
+    offset += is_long ? 3 : 2;
+    printf("%-16s %4zu ", is_long ? "OP_CLOSURE_LONG" : "OP_CLOSURE",
+           constant);
     print_value(chunk->constants.value[constant]);
     printf("\n");
     ObjFunction *function = AS_FUNCTION(chunk->constants.value[constant]);
     for (size_t j = 0; j < function->upvalue_count; ++j) {
-      size_t is_local = chunk->code[offset++];
-      size_t index = chunk->code[offset++];
-      printf("%04zu      |                     %s %zu\n", offset - 2,
+      size_t start = offset;
+      bool is_local = chunk->code[offset] & CAPTURE_LOCAL;
+      size_t index = capture_index(chunk, &offset);
+      printf("%04zu      |                     %s %zu\n", start,
              is_local ? "local" : "upvalue", index);
     }
+    for (size_t j = 0; j < function->flat_upvalue_count; ++j) {
+      size_t start = offset;
+      bool is_local = chunk->code[offset] & CAPTURE_LOCAL;
+      size_t index = capture_index(chunk, &offset);
+      printf("%04zu      |                     copy %s %zu\n", start,
+             is_local ? "local" : "flat upvalue", index);
+    }
     return offset;
   }
   case OP_INVOKE:
     return invoke_instruction("OP_INVOKE", chunk, offset);
   case OP_SUPER_INVOKE:
     return invoke_instruction("OP_SUPER_INVOKE", chunk, offset);
+  case OP_TAIL_INVOKE:
+    return invoke_instruction("OP_TAIL_INVOKE", chunk, offset);
+  case OP_SUPER_TAIL_INVOKE:
+    return invoke_instruction("OP_SUPER_TAIL_INVOKE", chunk, offset);
   case OP_CLOSE_UPVALUE:
     return simple_instruction("OP_CLOSE_UPVALUE", offset);
+  case OP_THROW:
+    return simple_instruction("OP_THROW", offset);
+  case OP_SWITCH:
+    return switch_instruction("OP_SWITCH", chunk, offset);
+  case OP_RETURN_VALUES:
+    return byte_instruction("OP_RETURN_VALUES", chunk, offset);
+  case OP_UNPACK:
+    return byte_instruction("OP_UNPACK", chunk, offset);
+  case OP_TUPLE:
+    return byte_instruction("OP_TUPLE", chunk, offset);
   case OP_RETURN:
     return simple_instruction("OP_RETURN", offset);
+  case OP_RETURN_INITIALIZER:
+    return simple_instruction("OP_RETURN_INITIALIZER", offset);
   case OP_CLASS:
     return constant_instruction("OP_CLASS", chunk, offset);
   case OP_INHERIT:
@@ -154,8 +350,311 @@ size_t disassemble_instruction(Chunk *chunk, size_t offset) {
     return constant_instruction("OP_METHOD", chunk, offset);
   case OP_PRIVATE_METHOD:
     return constant_instruction("OP_PRIVATE_METHOD", chunk, offset);
+  case OP_CONSTANT_LONG:
+    return constant_instruction("OP_CONSTANT_LONG", chunk, offset);
+  case OP_GET_GLOBAL_LONG:
+    return constant_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
+  case OP_DEFINE_GLOBAL_LONG:
+    return constant_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+  case OP_SET_GLOBAL_LONG:
+    return constant_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+  case OP_GET_PROPERTY_LONG:
+    return property_instruction("OP_GET_PROPERTY_LONG", chunk, offset);
+  case OP_SET_PROPERTY_LONG:
+    return constant_instruction("OP_SET_PROPERTY_LONG", chunk, offset);
+  case OP_GET_SUPER_LONG:
+    return constant_instruction("OP_GET_SUPER_LONG", chunk, offset);
+  case OP_INVOKE_LONG:
+    return invoke_instruction("OP_INVOKE_LONG", chunk, offset);
+  case OP_SUPER_INVOKE_LONG:
+    return invoke_instruction("OP_SUPER_INVOKE_LONG", chunk, offset);
+  case OP_TAIL_INVOKE_LONG:
+    return invoke_instruction("OP_TAIL_INVOKE_LONG", chunk, offset);
+  case OP_SUPER_TAIL_INVOKE_LONG:
+    return invoke_instruction("OP_SUPER_TAIL_INVOKE_LONG", chunk, offset);
+  case OP_CLASS_LONG:
+    return constant_instruction("OP_CLASS_LONG", chunk, offset);
+  case OP_METHOD_LONG:
+    return constant_instruction("OP_METHOD_LONG", chunk, offset);
+  case OP_PRIVATE_METHOD_LONG:
+    return constant_instruction("OP_PRIVATE_METHOD_LONG", chunk, offset);
+  case OP_GET_LOCAL_LONG:
+    return short_instruction("OP_GET_LOCAL_LONG", chunk, offset);
+  case OP_SET_LOCAL_LONG:
+    return short_instruction("OP_SET_LOCAL_LONG", chunk, offset);
+  case OP_GET_UPVALUE_LONG:
+    return short_instruction("OP_GET_UPVALUE_LONG", chunk, offset);
+  case OP_SET_UPVALUE_LONG:
+    return short_instruction("OP_SET_UPVALUE_LONG", chunk, offset);
+  case OP_GET_FLAT_UPVALUE_LONG:
+    return short_instruction("OP_GET_FLAT_UPVALUE_LONG", chunk, offset);
+  case OP_INCREMENT_LOCAL:
+    return local_constant_instruction("OP_INCREMENT_LOCAL", chunk, offset);
+  case OP_ADD_LOCALS:
+    return locals_instruction("OP_ADD_LOCALS", chunk, offset);
+  case OP_SUBTRACT_LOCALS:
+    return locals_instruction("OP_SUBTRACT_LOCALS", chunk, offset);
+  case OP_MULTIPLY_LOCALS:
+    return locals_instruction("OP_MULTIPLY_LOCALS", chunk, offset);
+  case OP_DIVIDE_LOCALS:
+    return locals_instruction("OP_DIVIDE_LOCALS", chunk, offset);
+  case OP_GREATER_LOCALS:
+    return locals_instruction("OP_GREATER_LOCALS", chunk, offset);
+  case OP_LESS_LOCALS:
+    return locals_instruction("OP_LESS_LOCALS", chunk, offset);
+  case OP_ADD_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_SUBTRACT_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_SUBTRACT_LOCAL_CONSTANT", chunk,
+                                      offset);
+  case OP_MULTIPLY_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_MULTIPLY_LOCAL_CONSTANT", chunk,
+                                      offset);
+  case OP_DIVIDE_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_DIVIDE_LOCAL_CONSTANT", chunk,
+                                      offset);
+  case OP_GREATER_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_GREATER_LOCAL_CONSTANT", chunk,
+                                      offset);
+  case OP_LESS_LOCAL_CONSTANT:
+    return local_constant_instruction("OP_LESS_LOCAL_CONSTANT", chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER_LOCALS:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_GREATER_LOCALS",
+                                  chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT",
+                                  chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS",
+                                  chunk, offset);
+  case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT",
+                                  chunk, offset);
+  case OP_JUMP_IF_NOT_LESS_LOCALS:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_LESS_LOCALS", chunk, offset);
+  case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT",
+                                  chunk, offset);
+  case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS",
+                                  chunk, offset);
+  case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT:
+    return fused_jump_instruction("OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT",
+                                  chunk, offset);
+  case OP_COPY_LOCAL:
+    return copy_instruction("OP_COPY_LOCAL", chunk, offset);
+  case OP_SET_LOCAL_CONSTANT:
+    return copy_instruction("OP_SET_LOCAL_CONSTANT", chunk, offset);
+  case OP_ASSIGN_ADD_LOCALS:
+    return assign_instruction("OP_ASSIGN_ADD_LOCALS", chunk, offset);
+  case OP_ASSIGN_ADD_LOCAL_CONSTANT:
+    return assign_instruction("OP_ASSIGN_ADD_LOCAL_CONSTANT", chunk, offset);
+  case OP_ASSIGN_SUBTRACT_LOCALS:
+    return assign_instruction("OP_ASSIGN_SUBTRACT_LOCALS", chunk, offset);
+  case OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT:
+    return assign_instruction("OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT", chunk,
+                              offset);
+  case OP_ASSIGN_MULTIPLY_LOCALS:
+    return assign_instruction("OP_ASSIGN_MULTIPLY_LOCALS", chunk, offset);
+  case OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT:
+    return assign_instruction("OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT", chunk,
+                              offset);
+  case OP_ASSIGN_DIVIDE_LOCALS:
+    return assign_instruction("OP_ASSIGN_DIVIDE_LOCALS", chunk, offset);
+  case OP_ASSIGN_DIVIDE_LOCAL_CONSTANT:
+    return assign_instruction("OP_ASSIGN_DIVIDE_LOCAL_CONSTANT", chunk, offset);
+  case OP_ADD_NUM:
+    return simple_instruction("OP_ADD_NUM", offset);
+  case OP_ADD_STR:
+    return simple_instruction("OP_ADD_STR", offset);
+  case OP_GET_FIELD:
+    return property_instruction("OP_GET_FIELD", chunk, offset);
+  case OP_CALL_CLOSURE:
+    return byte_instruction("OP_CALL_CLOSURE", chunk, offset);
+  case OP_GET_ELEMENT_ARRAY:
+    return simple_instruction("OP_GET_ELEMENT_ARRAY", offset);
   default:
     printf("Unkown opcode %d\n", chunk->code[offset]);
     return offset - 1;
   }
 }
+
+#ifdef DEBUG_OPCODE_PAIRS
+// Number of pairs printed by print_opcode_pairs.
+#define OPCODE_PAIRS_SHOWN 32
+
+static const char *opcode_names[UINT8_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_GET_FLAT_UPVALUE] = "OP_GET_FLAT_UPVALUE",
+    [OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+    [OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+    [OP_GET_ELEMENT] = "OP_GET_ELEMENT",
+    [OP_SET_ELEMENT] = "OP_SET_ELEMENT",
+    [OP_GET_SUPER] = "OP_GET_SUPER",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_MODULO] = "OP_MODULO",
+    [OP_FLOOR_DIVIDE] = "OP_FLOOR_DIVIDE",
+    [OP_BIT_XOR] = "OP_BIT_XOR",
+    [OP_SHIFT_LEFT] = "OP_SHIFT_LEFT",
+    [OP_SHIFT_RIGHT] = "OP_SHIFT_RIGHT",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL] = "OP_JUMP_IF_NOT_GREATER_EQUAL",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL] = "OP_JUMP_IF_NOT_LESS_EQUAL",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_FORPREP] = "OP_FORPREP",
+    [OP_FORLOOP] = "OP_FORLOOP",
+    [OP_CALL] = "OP_CALL",
+    [OP_TAIL_CALL] = "OP_TAIL_CALL",
+    [OP_INHERIT] = "OP_INHERIT",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+    [OP_TAIL_INVOKE] = "OP_TAIL_INVOKE",
+    [OP_SUPER_TAIL_INVOKE] = "OP_SUPER_TAIL_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_THROW] = "OP_THROW",
+    [OP_SWITCH] = "OP_SWITCH",
+    [OP_RETURN_VALUES] = "OP_RETURN_VALUES",
+    [OP_UNPACK] = "OP_UNPACK",
+    [OP_TUPLE] = "OP_TUPLE",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_RETURN_INITIALIZER] = "OP_RETURN_INITIALIZER",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_PRIVATE_METHOD] = "OP_PRIVATE_METHOD",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_PROPERTY_LONG] = "OP_GET_PROPERTY_LONG",
+    [OP_SET_PROPERTY_LONG] = "OP_SET_PROPERTY_LONG",
+    [OP_GET_SUPER_LONG] = "OP_GET_SUPER_LONG",
+    [OP_INVOKE_LONG] = "OP_INVOKE_LONG",
+    [OP_SUPER_INVOKE_LONG] = "OP_SUPER_INVOKE_LONG",
+    [OP_TAIL_INVOKE_LONG] = "OP_TAIL_INVOKE_LONG",
+    [OP_SUPER_TAIL_INVOKE_LONG] = "OP_SUPER_TAIL_INVOKE_LONG",
+    [OP_CLOSURE_LONG] = "OP_CLOSURE_LONG",
+    [OP_CLASS_LONG] = "OP_CLASS_LONG",
+    [OP_METHOD_LONG] = "OP_METHOD_LONG",
+    [OP_PRIVATE_METHOD_LONG] = "OP_PRIVATE_METHOD_LONG",
+    [OP_GET_LOCAL_LONG] = "OP_GET_LOCAL_LONG",
+    [OP_SET_LOCAL_LONG] = "OP_SET_LOCAL_LONG",
+    [OP_GET_UPVALUE_LONG] = "OP_GET_UPVALUE_LONG",
+    [OP_SET_UPVALUE_LONG] = "OP_SET_UPVALUE_LONG",
+    [OP_GET_FLAT_UPVALUE_LONG] = "OP_GET_FLAT_UPVALUE_LONG",
+    [OP_INCREMENT_LOCAL] = "OP_INCREMENT_LOCAL",
+    [OP_ADD_LOCALS] = "OP_ADD_LOCALS",
+    [OP_SUBTRACT_LOCALS] = "OP_SUBTRACT_LOCALS",
+    [OP_MULTIPLY_LOCALS] = "OP_MULTIPLY_LOCALS",
+    [OP_DIVIDE_LOCALS] = "OP_DIVIDE_LOCALS",
+    [OP_GREATER_LOCALS] = "OP_GREATER_LOCALS",
+    [OP_LESS_LOCALS] = "OP_LESS_LOCALS",
+    [OP_ADD_LOCAL_CONSTANT] = "OP_ADD_LOCAL_CONSTANT",
+    [OP_SUBTRACT_LOCAL_CONSTANT] = "OP_SUBTRACT_LOCAL_CONSTANT",
+    [OP_MULTIPLY_LOCAL_CONSTANT] = "OP_MULTIPLY_LOCAL_CONSTANT",
+    [OP_DIVIDE_LOCAL_CONSTANT] = "OP_DIVIDE_LOCAL_CONSTANT",
+    [OP_GREATER_LOCAL_CONSTANT] = "OP_GREATER_LOCAL_CONSTANT",
+    [OP_LESS_LOCAL_CONSTANT] = "OP_LESS_LOCAL_CONSTANT",
+    [OP_JUMP_IF_NOT_GREATER_LOCALS] = "OP_JUMP_IF_NOT_GREATER_LOCALS",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS] =
+        "OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS",
+    [OP_JUMP_IF_NOT_LESS_LOCALS] = "OP_JUMP_IF_NOT_LESS_LOCALS",
+    [OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS] = "OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS",
+    [OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT] =
+        "OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT",
+    [OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT] =
+        "OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT",
+    [OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT] = "OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT",
+    [OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT] =
+        "OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT",
+    [OP_COPY_LOCAL] = "OP_COPY_LOCAL",
+    [OP_SET_LOCAL_CONSTANT] = "OP_SET_LOCAL_CONSTANT",
+    [OP_ASSIGN_ADD_LOCALS] = "OP_ASSIGN_ADD_LOCALS",
+    [OP_ASSIGN_SUBTRACT_LOCALS] = "OP_ASSIGN_SUBTRACT_LOCALS",
+    [OP_ASSIGN_MULTIPLY_LOCALS] = "OP_ASSIGN_MULTIPLY_LOCALS",
+    [OP_ASSIGN_DIVIDE_LOCALS] = "OP_ASSIGN_DIVIDE_LOCALS",
+    [OP_ASSIGN_ADD_LOCAL_CONSTANT] = "OP_ASSIGN_ADD_LOCAL_CONSTANT",
+    [OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT] = "OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT",
+    [OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT] = "OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT",
+    [OP_ASSIGN_DIVIDE_LOCAL_CONSTANT] = "OP_ASSIGN_DIVIDE_LOCAL_CONSTANT",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_GET_FIELD] = "OP_GET_FIELD",
+    [OP_CALL_CLOSURE] = "OP_CALL_CLOSURE",
+    [OP_GET_ELEMENT_ARRAY] = "OP_GET_ELEMENT_ARRAY",
+};
+
+static const char *opcode_name(size_t instruction) {
+  return opcode_names[instruction] != NULL ? opcode_names[instruction] : "?";
+}
+
+static size_t opcode_pairs[UINT8_COUNT][UINT8_COUNT];
+static int previous_opcode = -1;
+
+/// Counts how often instruction is executed right after the previous one.
+/// Calls and returns are counted too, as pairs across the two functions.
+void count_opcode_pair(uint8_t instruction) {
+  if (previous_opcode >= 0) {
+    opcode_pairs[previous_opcode][instruction]++;
+  }
+  previous_opcode = instruction;
+}
+
+/// Prints the most frequently executed pairs of opcodes to stderr, which
+/// shows the sequences worth fusing into superinstructions.
+void print_opcode_pairs() {
+  size_t total = 0;
+  for (size_t a = 0; a < UINT8_COUNT; ++a) {
+    for (size_t b = 0; b < UINT8_COUNT; ++b) {
+      total += opcode_pairs[a][b];
+    }
+  }
+  fprintf(stderr, "== opcode pairs (%zu executed) ==\n", total);
+  for (size_t shown = 0; shown < OPCODE_PAIRS_SHOWN; ++shown) {
+    size_t best_a = 0;
+    size_t best_b = 0;
+    for (size_t a = 0; a < UINT8_COUNT; ++a) {
+      for (size_t b = 0; b < UINT8_COUNT; ++b) {
+        if (opcode_pairs[a][b] > opcode_pairs[best_a][best_b]) {
+          best_a = a;
+          best_b = b;
+        }
+      }
+    }
+    size_t count = opcode_pairs[best_a][best_b];
+    if (count == 0) {
+      break;
+    }
+    fprintf(stderr, "%12zu %5.1f%%  %s %s\n", count, 100.0 * count / total,
+            opcode_name(best_a), opcode_name(best_b));
+    opcode_pairs[best_a][best_b] = 0;
+  }
+}
+#endif /* ifdef DEBUG_OPCODE_PAIRS */
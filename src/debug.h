@@ -5,3 +5,7 @@
 
 void disassemble_chunk(Chunk *chunk, const char *name);
 size_t disassemble_instruction(Chunk *chunk, size_t offset);
+#ifdef DEBUG_OPCODE_PAIRS
+void count_opcode_pair(uint8_t instruction);
+void print_opcode_pairs();
+#endif /* ifdef DEBUG_OPCODE_PAIRS */
@@ -0,0 +1,196 @@
+#include "intern.h"
+#include "memory.h"
+#include "object.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define INTERN_MAX_LOAD 0.75
+// Sets growing to at least this many buckets are resized incrementally.
+#define INTERN_INCREMENTAL_MIN 1024
+// Number of old buckets migrated by every insertion during a resize.
+#define INTERN_MIGRATE_STEP 32
+
+// Removed strings leave this marker behind and keep their hash, so probe
+// sequences running through the bucket continue past it.
+static char tombstone_marker;
+#define TOMBSTONE ((ObjString *)&tombstone_marker)
+
+// Stored hashes are never zero, which is reserved for empty buckets.
+#define SLOT_HASH(hash) ((hash) | 1u)
+
+#if defined(__GNUC__) || defined(__clang__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
+
+void init_intern_set(InternSet *set) {
+  set->count = 0;
+  set->capacity = 0;
+  set->hashes = NULL;
+  set->keys = NULL;
+  set->old_hashes = NULL;
+  set->old_keys = NULL;
+  set->old_capacity = 0;
+  set->old_count = 0;
+  set->migrated = 0;
+}
+
+void free_intern_set(InternSet *set) {
+  FREE_ARRAY(uint32_t, set->hashes, set->capacity);
+  FREE_ARRAY(ObjString *, set->keys, set->capacity);
+  FREE_ARRAY(uint32_t, set->old_hashes, set->old_capacity);
+  FREE_ARRAY(ObjString *, set->old_keys, set->old_capacity);
+  init_intern_set(set);
+}
+
+static ObjString *find_string(uint32_t *hashes, ObjString **keys,
+                              size_t capacity, const char *chars,
+                              size_t length, uint32_t hash) {
+  uint32_t slot_hash = SLOT_HASH(hash);
+  size_t index = hash & (capacity - 1);
+  PREFETCH(&keys[index]);
+  for (;;) {
+    if (hashes[index] == slot_hash) {
+      ObjString *key = keys[index];
+      if (key != TOMBSTONE && key->length == length &&
+          memcmp(key->chars, chars, length) == 0) {
+        return key;
+      }
+    } else if (hashes[index] == 0) {
+      return NULL;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+ObjString *intern_set_find(InternSet *set, const char *chars, size_t length,
+                           uint32_t hash) {
+  ObjString *string = NULL;
+  if (set->count != 0) {
+    string = find_string(set->hashes, set->keys, set->capacity, chars, length,
+                         hash);
+  }
+  if (string == NULL && set->old_keys != NULL) {
+    string = find_string(set->old_hashes, set->old_keys, set->old_capacity,
+                         chars, length, hash);
+  }
+  return string;
+}
+
+/// Stores a string that is not yet in the set into the first free bucket of
+/// its probe sequence.
+static void insert_string(InternSet *set, ObjString *string) {
+  size_t index = string->hash & (set->capacity - 1);
+  while (set->hashes[index] != 0 && set->keys[index] != TOMBSTONE) {
+    index = (index + 1) & (set->capacity - 1);
+  }
+  if (set->hashes[index] == 0) {
+    set->count++;
+  }
+  set->hashes[index] = SLOT_HASH(string->hash);
+  set->keys[index] = string;
+}
+
+/// Moves up to budget buckets from the old arrays into the new ones, leaving
+/// tombstones behind, and frees the old arrays once all buckets are visited.
+static void migrate_strings(InternSet *set, size_t budget) {
+  while (budget > 0 && set->migrated < set->old_capacity) {
+    size_t index = set->migrated++;
+    budget--;
+    if (set->old_hashes[index] == 0) {
+      continue;
+    }
+    set->old_count--;
+    if (set->old_keys[index] != TOMBSTONE) {
+      insert_string(set, set->old_keys[index]);
+      set->old_keys[index] = TOMBSTONE;
+    }
+  }
+  if (set->migrated == set->old_capacity) {
+    FREE_ARRAY(uint32_t, set->old_hashes, set->old_capacity);
+    FREE_ARRAY(ObjString *, set->old_keys, set->old_capacity);
+    set->old_hashes = NULL;
+    set->old_keys = NULL;
+    set->old_capacity = 0;
+    set->old_count = 0;
+    set->migrated = 0;
+  }
+}
+
+static void adjust_capacity(InternSet *set, size_t capacity) {
+  if (set->old_keys != NULL) {
+    migrate_strings(set, set->old_capacity);
+  }
+  uint32_t *hashes = ALLOCATE_ZEROED(uint32_t, capacity);
+  ObjString **keys = ALLOCATE_ZEROED(ObjString *, capacity);
+  uint32_t *old_hashes = set->hashes;
+  ObjString **old_keys = set->keys;
+  size_t old_capacity = set->capacity;
+  set->old_hashes = old_hashes;
+  set->old_keys = old_keys;
+  set->old_capacity = old_capacity;
+  set->old_count = set->count;
+  set->migrated = 0;
+  set->hashes = hashes;
+  set->keys = keys;
+  set->capacity = capacity;
+  set->count = 0;
+  if (capacity < INTERN_INCREMENTAL_MIN) {
+    migrate_strings(set, old_capacity);
+  }
+}
+
+void intern_set_add(InternSet *set, ObjString *string) {
+  if (set->old_keys != NULL) {
+    migrate_strings(set, INTERN_MIGRATE_STEP);
+  }
+  if (set->count + set->old_count + 1 > set->capacity * INTERN_MAX_LOAD) {
+    adjust_capacity(set, GROW_CAPACITY(set->capacity));
+  }
+  insert_string(set, string);
+}
+
+/// Turns tombstones that are directly followed by an empty bucket back into
+/// empty buckets. No probe sequence can continue past such a tombstone, so
+/// this shortens probes after a sweep without moving any strings.
+static void clear_tombstones(InternSet *set) {
+  size_t mask = set->capacity - 1;
+  size_t empty = 0;
+  while (empty < set->capacity && set->hashes[empty] != 0) {
+    empty++;
+  }
+  if (empty == set->capacity) {
+    return;
+  }
+  for (size_t i = 1; i < set->capacity; ++i) {
+    size_t index = (empty - i) & mask;
+    if (set->keys[index] == TOMBSTONE &&
+        set->hashes[(index + 1) & mask] == 0) {
+      set->hashes[index] = 0;
+      set->keys[index] = NULL;
+      set->count--;
+    }
+  }
+}
+
+/// Drops every string that was not marked by the collector. Interned strings
+/// are weak references, so this runs between marking and sweeping.
+void intern_set_remove_white(InternSet *set) {
+  for (size_t i = 0; i < set->capacity; ++i) {
+    ObjString *key = set->keys[i];
+    if (key != NULL && key != TOMBSTONE && !key->obj.is_marked) {
+      set->keys[i] = TOMBSTONE;
+    }
+  }
+  for (size_t i = set->migrated; i < set->old_capacity; ++i) {
+    ObjString *key = set->old_keys[i];
+    if (key != NULL && key != TOMBSTONE && !key->obj.is_marked) {
+      set->old_keys[i] = TOMBSTONE;
+    }
+  }
+  if (set->capacity != 0) {
+    clear_tombstones(set);
+  }
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "common.h"
+#include "value.h"
+#include <stdint.h>
+
+/// The set of interned strings. Hashes are kept in their own array next to
+/// the string pointers so probing can reject most buckets without touching
+/// the strings. A hash of zero marks an empty bucket. Like Table, large sets
+/// are resized incrementally.
+typedef struct InternSet {
+  size_t count;
+  size_t capacity;
+  uint32_t *hashes;
+  ObjString **keys;
+  uint32_t *old_hashes; ///< Hashes still being migrated, or NULL.
+  ObjString **old_keys; ///< Strings still being migrated, or NULL.
+  size_t old_capacity;  ///< Capacity of the old arrays.
+  size_t old_count;     ///< Occupied buckets left to migrate.
+  size_t migrated;      ///< Index of the next old bucket to migrate.
+} InternSet;
+
+void init_intern_set(InternSet *set);
+void free_intern_set(InternSet *set);
+ObjString *intern_set_find(InternSet *set, const char *chars, size_t length,
+                           uint32_t hash);
+void intern_set_add(InternSet *set, ObjString *string);
+void intern_set_remove_white(InternSet *set);
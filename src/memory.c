@@ -1,6 +1,7 @@
 #include "memory.h"
 #include "chunk.h"
 #include "compiler.h"
+#include "intern.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -37,6 +38,22 @@ void *reallocate(void *pointer, size_t old_size, size_t new_size) {
   return result;
 }
 
+/// Allocates zero-filled memory, accounting for it like reallocate does.
+/// Large zeroed blocks come straight from the system, which maps them in
+/// lazily instead of filling them upfront.
+void *allocate_zeroed(size_t size) {
+  vm.bytes_allocated += size;
+#ifdef DEBUG_STRESS_GC
+  collect_garbage();
+#endif /* ifdef DEBUG_STRESS_GC */
+  if (vm.bytes_allocated > vm.next_gc) {
+    collect_garbage();
+  }
+  void *result = calloc(1, size);
+  assert(result && "Could not allocate memory for new array");
+  return result;
+}
+
 static void free_object(Obj *object) {
 #ifdef DEBUG_LOG_GC
   printf("%p free type %d\n", (void *)object, object->type);
@@ -54,19 +71,24 @@ static void free_object(Obj *object) {
     break;
   case OBJ_CLASS: {
     ObjClass *class = (ObjClass *)object;
-    free_table(&class->methods);
-    free_table(&class->private_methods);
+    free_method_table(&class->methods);
+    free_method_table(&class->private_methods);
     FREE(ObjClass, object);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure *closure = (ObjClosure *)object;
-    FREE_ARRAY(ObjUpvalue *, closure->upvalues, closure->upvalue_count);
-    FREE(ObjClosure, object);
+    reallocate(object,
+               CLOSURE_SIZE(closure->upvalue_count,
+                            closure->flat_upvalue_count),
+               0);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
+    if (function->code != NULL) {
+      FREE_ARRAY(Instruction, function->code, function->chunk.count);
+    }
     free_chunk(&function->chunk);
     FREE(ObjFunction, object);
     break;
@@ -86,6 +108,9 @@ static void free_object(Obj *object) {
     FREE(ObjString, object);
     break;
   }
+  case OBJ_TUPLE:
+    reallocate(object, TUPLE_SIZE(((ObjTuple *)object)->length), 0);
+    break;
   case OBJ_UPVALUE:
     FREE(ObjUpvalue, object);
     break;
@@ -150,8 +175,9 @@ static void blacken_object(Obj *object) {
   case OBJ_CLASS: {
     ObjClass *class = (ObjClass *)object;
     mark_object((Obj *)class->name);
-    mark_table(&class->methods);
-    mark_table(&class->private_methods);
+    mark_method_table(&class->methods);
+    mark_method_table(&class->private_methods);
+    mark_object((Obj *)class->initializer);
     break;
   }
   case OBJ_CLOSURE: {
@@ -160,12 +186,25 @@ static void blacken_object(Obj *object) {
     for (size_t i = 0; i < closure->upvalue_count; ++i) {
       mark_object((Obj *)closure->upvalues[i]);
     }
+    for (size_t i = 0; i < closure->flat_upvalue_count; ++i) {
+      mark_value(closure->flat_upvalues[i]);
+    }
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction *function = (ObjFunction *)object;
     mark_object((Obj *)function->name);
     mark_array(&function->chunk.constants);
+    for (size_t i = 0; i < function->chunk.path_count; ++i) {
+      mark_value(function->chunk.paths[i].path);
+    }
+    for (size_t i = 0; i < function->chunk.switch_count; ++i) {
+      SwitchTable *table = &function->chunk.switches[i];
+      mark_table(&table->strings);
+      for (size_t j = 0; j < table->case_count; ++j) {
+        mark_value(table->cases[j].value);
+      }
+    }
     break;
   }
   case OBJ_INSTANCE: {
@@ -174,6 +213,13 @@ static void blacken_object(Obj *object) {
     mark_table(&instance->fields);
     break;
   }
+  case OBJ_TUPLE: {
+    ObjTuple *tuple = (ObjTuple *)object;
+    for (size_t i = 0; i < tuple->length; ++i) {
+      mark_value(tuple->values[i]);
+    }
+    break;
+  }
   case OBJ_UPVALUE:
     mark_value(((ObjUpvalue *)object)->closed);
     break;
@@ -197,6 +243,8 @@ static void mark_roots() {
   mark_table(&vm.globals);
   mark_compiler_roots();
   mark_object((Obj *)vm.init_string);
+  mark_array(&vm.symbols);
+  mark_array(&vm.index_strings);
 }
 
 static void trace_references() {
@@ -235,7 +283,7 @@ void collect_garbage() {
 
   mark_roots();
   trace_references();
-  table_remove_white(&vm.strings);
+  intern_set_remove_white(&vm.strings);
   sweep();
   vm.next_gc = vm.bytes_allocated * GC_HEAP_GROW_FACTOR;
 
@@ -6,6 +6,9 @@
 #define ALLOCATE(type, count)                                                  \
   (type *)reallocate(NULL, 0, sizeof(type) * (count))
 
+#define ALLOCATE_ZEROED(type, count)                                           \
+  (type *)allocate_zeroed(sizeof(type) * (count))
+
 #define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) ((capacity) < 8 ? 8 : (capacity)*2)
@@ -16,6 +19,7 @@
   reallocate(pointer, sizeof(type) * (old_count), 0)
 
 void *reallocate(void *pointer, size_t old_size, size_t new_size);
+void *allocate_zeroed(size_t size);
 void mark_object(Obj *object);
 void mark_value(Value value);
 void collect_garbage();
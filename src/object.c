@@ -1,5 +1,6 @@
 #include "object.h"
 #include "chunk.h"
+#include "intern.h"
 #include "memory.h"
 #include "table.h"
 #include "value.h"
@@ -37,20 +38,27 @@ ObjBoundMethod *new_bound_method(Value reciever, ObjClosure *method) {
 ObjClass *new_class(ObjString *name) {
   ObjClass *class = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
   class->name = name;
-  init_table(&class->methods);
-  init_table(&class->private_methods);
+  init_method_table(&class->methods);
+  init_method_table(&class->private_methods);
+  class->initializer = NULL;
+  class->field_hint = 0;
   return class;
 }
 
 ObjClosure *new_closure(ObjFunction *function) {
-  ObjUpvalue **upvalues = ALLOCATE(ObjUpvalue *, function->upvalue_count);
-  for (size_t i = 0; i < function->upvalue_count; ++i) {
-    upvalues[i] = NULL;
-  }
-  ObjClosure *closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+  ObjClosure *closure = (ObjClosure *)allocate_object(
+      CLOSURE_SIZE(function->upvalue_count, function->flat_upvalue_count),
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalue_count = function->upvalue_count;
+  closure->flat_upvalue_count = function->flat_upvalue_count;
+  closure->flat_upvalues = (Value *)&closure->upvalues[closure->upvalue_count];
+  for (size_t i = 0; i < function->upvalue_count; ++i) {
+    closure->upvalues[i] = NULL;
+  }
+  for (size_t i = 0; i < function->flat_upvalue_count; ++i) {
+    closure->flat_upvalues[i] = NIL_VAL;
+  }
   return closure;
 }
 
@@ -58,7 +66,10 @@ ObjFunction *new_function() {
   ObjFunction *function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalue_count = 0;
+  function->flat_upvalue_count = 0;
+  function->max_stack = 0;
   function->name = NULL;
+  function->code = NULL;
   init_chunk(&function->chunk);
   return function;
 }
@@ -83,6 +94,57 @@ ObjArray *new_array() {
   return array;
 }
 
+/// Hashes a value so that values which are equal hash the same, which makes
+/// integers hash like the doubles they are equal to.
+static uint32_t hash_value(Value value) {
+  if (IS_NUMBER(value)) {
+    // Adding zero turns -0 into 0, which it is equal to.
+    double number = AS_NUMBER(value) + 0.0;
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(double));
+    return (uint32_t)(bits ^ (bits >> 32));
+  }
+  if (IS_STRING(value)) {
+    return AS_STRING(value)->hash;
+  }
+  if (IS_TUPLE(value)) {
+    return AS_TUPLE(value)->hash;
+  }
+  if (IS_OBJ(value)) {
+    uint64_t address = (uint64_t)(uintptr_t)AS_OBJ(value);
+    return (uint32_t)(address ^ (address >> 32));
+  }
+  if (IS_BOOL(value)) {
+    return AS_BOOL(value) ? 3 : 2;
+  }
+  return 1;
+}
+
+ObjTuple *new_tuple(Value *values, size_t length) {
+  ObjTuple *tuple = (ObjTuple *)allocate_object(TUPLE_SIZE(length), OBJ_TUPLE);
+  tuple->length = length;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < length; ++i) {
+    tuple->values[i] = values[i];
+    hash ^= hash_value(values[i]);
+    hash *= 16777619;
+  }
+  tuple->hash = hash;
+  return tuple;
+}
+
+bool tuples_equal(ObjTuple *a, ObjTuple *b) {
+  if (a->hash != b->hash || a->length != b->length) {
+    return false;
+  }
+  for (size_t i = 0; i < a->length; ++i) {
+    if (!values_equal(a->values[i], b->values[i])) {
+      return false;
+    }
+  }
+  return true;
+}
+
 static char *format(char *chars) {
   size_t max_length = strlen(chars);
   char *formated = malloc(max_length + 1);
@@ -127,21 +189,104 @@ static ObjString *allocate_string(char *chars, size_t length, uint32_t hash,
   string->length = length;
   string->chars = string_literal ? format(chars) : chars;
   string->hash = hash;
+  string->symbol = NO_SYMBOL;
   push(OBJ_VAL(string));
-  table_set(&vm.strings, string, NIL_VAL);
+  intern_set_add(&vm.strings, string);
   pop();
   return string;
 }
 
-static uint32_t hash_string(const char *key, size_t length) {
-  uint32_t hash = 2166136261u;
+#ifdef KEYED_HASH
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3)                                              \
+  do {                                                                         \
+    v0 += v1;                                                                  \
+    v1 = ROTL64(v1, 13);                                                       \
+    v1 ^= v0;                                                                  \
+    v0 = ROTL64(v0, 32);                                                       \
+    v2 += v3;                                                                  \
+    v3 = ROTL64(v3, 16);                                                       \
+    v3 ^= v2;                                                                  \
+    v0 += v3;                                                                  \
+    v3 = ROTL64(v3, 21);                                                       \
+    v3 ^= v0;                                                                  \
+    v2 += v1;                                                                  \
+    v1 = ROTL64(v1, 17);                                                       \
+    v1 ^= v2;                                                                  \
+    v2 = ROTL64(v2, 32);                                                       \
+  } while (false)
+
+/// SipHash-1-3 keyed with the per-process hash seed. Without the key an
+/// attacker cannot predict which strings collide.
+static uint64_t siphash(const char *key, size_t length, uint64_t k0,
+                        uint64_t k1) {
+  uint64_t v0 = k0 ^ 0x736f6d6570736575ull;
+  uint64_t v1 = k1 ^ 0x646f72616e646f6dull;
+  uint64_t v2 = k0 ^ 0x6c7967656e657261ull;
+  uint64_t v3 = k1 ^ 0x7465646279746573ull;
+  const uint8_t *in = (const uint8_t *)key;
+  const uint8_t *end = in + (length - length % 8);
+  for (; in != end; in += 8) {
+    uint64_t m;
+    memcpy(&m, in, sizeof(m));
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+  }
+  uint64_t last = (uint64_t)length << 56;
+  for (size_t i = 0; i < length % 8; ++i) {
+    last |= (uint64_t)in[i] << (8 * i);
+  }
+  v3 ^= last;
+  SIP_ROUND(v0, v1, v2, v3);
+  v0 ^= last;
+  v2 ^= 0xff;
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  SIP_ROUND(v0, v1, v2, v3);
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+#endif /* ifdef KEYED_HASH */
+
+/// Hashes the characters of a string.
+///
+/// The hash depends on vm.hash_seed, which is chosen randomly for every
+/// process, so keys taken from untrusted input cannot be precomputed to
+/// collide. With KEYED_HASH defined the hash is SipHash keyed by the seed,
+/// otherwise it is FNV-1a started from a seeded offset basis and finished with
+/// an avalanche step so the low bits used for bucket indexes depend on every
+/// input bit.
+///
+/// Parameters:
+///   key: The characters to hash.
+///   length: The number of characters.
+///
+/// Returns:
+///   The 32-bit hash of the characters.
+uint32_t hash_string(const char *key, size_t length) {
+#ifdef KEYED_HASH
+  uint64_t k1 = vm.hash_seed * 0x9e3779b97f4a7c15ull;
+  uint64_t hash = siphash(key, length, vm.hash_seed, k1 ^ (k1 >> 31));
+  return (uint32_t)(hash ^ (hash >> 32));
+#else
+  uint32_t hash = 2166136261u ^ (uint32_t)vm.hash_seed;
   for (size_t i = 0; i < length; ++i) {
     hash ^= (uint32_t)key[i];
     hash *= 16777619;
   }
+  hash ^= (uint32_t)(vm.hash_seed >> 32);
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
   return hash;
+#endif /* ifdef KEYED_HASH */
 }
-/// Checks converts an int to a string.
+
+/// Checks converts an int to a string. Array elements are keyed by these
+/// strings, so the strings for indices are kept in vm.index_strings and looked
+/// up directly. This also keeps them reachable while an element is stored.
 ///
 /// Parameters:
 ///   i: The integer to be converted to an string.
@@ -149,17 +294,23 @@ static uint32_t hash_string(const char *key, size_t length) {
 /// Returns:
 ///   An ObjectString containing the digits of the int.
 ObjString *int_to_string(int i) {
-  size_t digits = (i == 0) ? 1 : log10(i) + 1;
-  char *number = ALLOCATE(char, digits + 1);
-  sprintf(number, "%d", i);
-  number[digits] = '\0';
-  ObjString *string = take_string(number, digits);
+  if (i >= 0 && (size_t)i < vm.index_strings.count) {
+    return AS_STRING(vm.index_strings.value[i]);
+  }
+  char digits[12];
+  int length = snprintf(digits, sizeof(digits), "%d", i);
+  ObjString *string = copy_string(digits, (size_t)length, false);
+  if (i >= 0 && (size_t)i == vm.index_strings.count) {
+    push(OBJ_VAL(string));
+    write_value_array(&vm.index_strings, OBJ_VAL(string));
+    pop();
+  }
   return string;
 }
 
 ObjString *take_string(char *chars, size_t length) {
   uint32_t hash = hash_string(chars, length);
-  ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+  ObjString *interned = intern_set_find(&vm.strings, chars, length, hash);
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length + 1);
     return interned;
@@ -169,7 +320,7 @@ ObjString *take_string(char *chars, size_t length) {
 
 ObjString *copy_string(const char *chars, size_t length, bool strlit) {
   uint32_t hash = hash_string(chars, length);
-  ObjString *interned = table_find_string(&vm.strings, chars, length, hash);
+  ObjString *interned = intern_set_find(&vm.strings, chars, length, hash);
   if (interned != NULL) {
     return interned;
   }
@@ -179,6 +330,25 @@ ObjString *copy_string(const char *chars, size_t length, bool strlit) {
   return allocate_string(heap_chars, length, hash, strlit);
 }
 
+/// Gives a name its symbol, the dense integer id method tables are keyed by.
+/// Named strings stay reachable through vm.symbols, so a symbol is never
+/// reused for different characters.
+///
+/// Parameters:
+///   name: The interned name.
+///
+/// Returns:
+///   The symbol of the name.
+uint32_t symbol_for(ObjString *name) {
+  if (name->symbol == NO_SYMBOL) {
+    push(OBJ_VAL(name));
+    write_value_array(&vm.symbols, OBJ_VAL(name));
+    pop();
+    name->symbol = (uint32_t)(vm.symbols.count - 1);
+  }
+  return name->symbol;
+}
+
 ObjUpvalue *new_upvalue(Value *slot) {
   ObjUpvalue *upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
   upvalue->location = slot;
@@ -208,6 +378,19 @@ static void print_array(ObjArray *array) {
   printf("]");
 }
 
+static void print_tuple(ObjTuple *tuple) {
+  printf("(");
+  for (size_t i = 0; i < tuple->length; ++i) {
+    print_value(tuple->values[i]);
+    if (i < tuple->length - 1) {
+      printf(", ");
+    }
+  }
+  // A single value prints the way it is written, with a trailing comma that
+  // keeps it apart from a parenthesized value.
+  printf(tuple->length == 1 ? ",)" : ")");
+}
+
 void print_object(Value value) {
   switch (OBJ_TYPE(value)) {
   case OBJ_ARRAY:
@@ -235,6 +418,9 @@ void print_object(Value value) {
   case OBJ_STRING:
     printf("%s", AS_CSTRING(value));
     break;
+  case OBJ_TUPLE:
+    print_tuple(AS_TUPLE(value));
+    break;
   case OBJ_UPVALUE:
     printf("upvalue");
     break;
@@ -17,6 +17,7 @@
 #define IS_NATIVE(value) is_obj_type(value, OBJ_NATIVE)
 #define IS_STRING(value) is_obj_type(value, OBJ_STRING)
 #define IS_ARRAY(value) is_obj_type(value, OBJ_ARRAY)
+#define IS_TUPLE(value) is_obj_type(value, OBJ_TUPLE)
 
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod *)AS_OBJ(value))
 #define AS_CLASS(value) ((ObjClass *)AS_OBJ(value))
@@ -27,6 +28,7 @@
 #define AS_STRING(value) ((ObjString *)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString *)AS_OBJ(value))->chars)
 #define AS_ARRAY(value) ((ObjArray *)AS_OBJ(value))
+#define AS_TUPLE(value) ((ObjTuple *)AS_OBJ(value))
 
 typedef enum ObjType {
   OBJ_BOUND_METHOD,
@@ -37,6 +39,7 @@ typedef enum ObjType {
   OBJ_NATIVE,
   OBJ_STRING,
   OBJ_ARRAY,
+  OBJ_TUPLE,
   OBJ_UPVALUE
 } ObjType;
 
@@ -46,11 +49,33 @@ struct Obj {
   struct Obj *next;
 };
 
+/// A word of the code the VM runs, decoded from the bytes of a chunk with one
+/// word for each byte, so that offsets into either agree. An opcode is the
+/// address of its handler, or the opcode itself where the VM dispatches with
+/// a switch. A constant operand points at the constant, a jump holds the
+/// instruction it lands on, and a two-byte operand is put together in its
+/// first word.
+typedef union Instruction {
+  const void *handler;
+  uintptr_t operand;
+  Value *constant;
+  union Instruction *target;
+} Instruction;
+
 typedef struct ObjFunction {
   Obj obj;
   size_t arity;
   size_t upvalue_count;
+  // Captured variables that are never assigned, whose values are copied into
+  // the closure instead of being shared through an upvalue.
+  size_t flat_upvalue_count;
+  // Most stack slots the function uses at once, including its own slot and
+  // its parameters.
+  size_t max_stack;
   Chunk chunk;
+  // The decoded chunk, made on the first call, which quickening rewrites in
+  // place. NULL until then.
+  Instruction *code;
   ObjString *name;
 } ObjFunction;
 
@@ -61,11 +86,14 @@ typedef struct ObjNative {
   NativeFn function;
 } ObjNative;
 
+#define NO_SYMBOL UINT32_MAX
+
 struct ObjString {
   Obj obj;
   size_t length;
   char *chars;
   uint32_t hash;
+  uint32_t symbol;
 };
 
 typedef struct ObjUpvalue {
@@ -78,15 +106,24 @@ typedef struct ObjUpvalue {
 typedef struct ObjClosure {
   Obj obj;
   ObjFunction *function;
-  ObjUpvalue **upvalues;
   size_t upvalue_count;
+  size_t flat_upvalue_count;
+  Value *flat_upvalues;   ///< Stored right after upvalues.
+  ObjUpvalue *upvalues[]; ///< Allocated along with the closure.
 } ObjClosure;
 
+// Size of a closure with room for count upvalues and flat_count copied values.
+#define CLOSURE_SIZE(count, flat_count)                                        \
+  (sizeof(ObjClosure) + sizeof(ObjUpvalue *) * (count) +                       \
+   sizeof(Value) * (flat_count))
+
 typedef struct ObjClass {
   Obj obj;
   ObjString *name;
-  Table methods;
-  Table private_methods;
+  MethodTable methods;
+  MethodTable private_methods;
+  ObjClosure *initializer; ///< Cached `init` method, or NULL.
+  size_t field_hint;       ///< Fields an instance has once `init` returns.
 } ObjClass;
 
 typedef struct ObjInstance {
@@ -107,16 +144,30 @@ typedef struct {
   size_t length;
 } ObjArray;
 
+typedef struct ObjTuple {
+  Obj obj;
+  size_t length;
+  uint32_t hash;  ///< Computed from the elements when the tuple is created.
+  Value values[]; ///< Allocated along with the tuple.
+} ObjTuple;
+
+// Size of a tuple with room for length values.
+#define TUPLE_SIZE(length) (sizeof(ObjTuple) + sizeof(Value) * (length))
+
 ObjBoundMethod *new_bound_method(Value reciever, ObjClosure *method);
 ObjClass *new_class(ObjString *name);
 ObjClosure *new_closure(ObjFunction *function);
 ObjFunction *new_function();
 ObjInstance *new_instance(ObjClass *klass);
 ObjNative *new_native(NativeFn function);
+uint32_t hash_string(const char *key, size_t length);
 ObjString *int_to_string(int i);
 ObjString *take_string(char *chars, size_t length);
 ObjString *copy_string(const char *chars, size_t length, bool strlit);
+uint32_t symbol_for(ObjString *name);
 ObjArray *new_array();
+ObjTuple *new_tuple(Value *values, size_t length);
+bool tuples_equal(ObjTuple *a, ObjTuple *b);
 ObjUpvalue *new_upvalue(Value *slot);
 void print_object(Value value);
 
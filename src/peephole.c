@@ -0,0 +1,286 @@
+#include "peephole.h"
+#include "chunk.h"
+#include "memory.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Chains of jumps are followed at most this many hops when threading.
+#define MAX_JUMP_HOPS 16
+
+static uint16_t read_short(uint8_t *code) {
+  return (uint16_t)(code[0] << 8 | code[1]);
+}
+
+static void write_short(uint8_t *code, uint16_t value) {
+  code[0] = (value >> 8) & 0xff;
+  code[1] = value & 0xff;
+}
+
+static bool is_jump(uint8_t instruction) {
+  switch (instruction) {
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_JUMP_IF_NOT_EQUAL:
+  case OP_JUMP_IF_EQUAL:
+  case OP_JUMP_IF_NOT_GREATER:
+  case OP_JUMP_IF_NOT_GREATER_EQUAL:
+  case OP_JUMP_IF_NOT_LESS:
+  case OP_JUMP_IF_NOT_LESS_EQUAL:
+  case OP_LOOP:
+  case OP_FORPREP:
+  case OP_FORLOOP:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool is_backward_jump(uint8_t instruction) {
+  return instruction == OP_LOOP || instruction == OP_FORLOOP;
+}
+
+/// Gets the offset execution continues at when the jump at offset is taken.
+static size_t jump_target(Chunk *chunk, size_t offset) {
+  size_t length = instruction_length(chunk, offset);
+  uint16_t jump = read_short(&chunk->code[offset + length - 2]);
+  if (is_backward_jump(chunk->code[offset])) {
+    return offset + length - jump;
+  }
+  return offset + length + jump;
+}
+
+/// Flags every offset in the chunk that some jump lands on.
+static void find_jump_targets(Chunk *chunk, bool *targets) {
+  for (size_t offset = 0; offset < chunk->count;
+       offset += instruction_length(chunk, offset)) {
+    if (is_jump(chunk->code[offset])) {
+      size_t target = jump_target(chunk, offset);
+      if (target < chunk->count) {
+        targets[target] = true;
+      }
+    }
+  }
+}
+
+/// Turns a constant that is pushed only to be popped again into a jump over
+/// the pop, unless another jump lands on the pop.
+static void remove_dead_constant(Chunk *chunk, size_t offset, bool *targets) {
+  uint8_t *code = &chunk->code[offset];
+  if (offset + 3 > chunk->count || code[2] != OP_POP || targets[offset + 2]) {
+    return;
+  }
+  code[0] = OP_JUMP;
+  write_short(&code[1], 0);
+}
+
+/// Points a forward jump straight at the end of the chain of jumps it lands
+/// on. A conditional jump only follows other conditional jumps when they
+/// test the same value, which it leaves on the stack.
+static void thread_jump(Chunk *chunk, size_t offset) {
+  uint8_t instruction = chunk->code[offset];
+  size_t target = jump_target(chunk, offset);
+  for (size_t hops = 0; hops < MAX_JUMP_HOPS && target < chunk->count;
+       ++hops) {
+    uint8_t next = chunk->code[target];
+    if (next != OP_JUMP &&
+        !(next == OP_JUMP_IF_FALSE && instruction == OP_JUMP_IF_FALSE)) {
+      break;
+    }
+    target = jump_target(chunk, target);
+  }
+  size_t length = instruction_length(chunk, offset);
+  size_t jump = target - (offset + length);
+  if (jump <= UINT16_MAX) {
+    write_short(&chunk->code[offset + length - 2], (uint16_t)jump);
+  }
+}
+
+#ifdef FUSE_ASSIGNMENTS
+/// Fuses a whole statement that assigns a local from locals and constants,
+/// such as `a := b + c;`, into one superinstruction.
+///
+/// Returns:
+///   true if the sequence at offset was fused.
+static bool fuse_assignment(Chunk *chunk, size_t offset) {
+  uint8_t *code = &chunk->code[offset];
+  size_t remaining = chunk->count - offset;
+  if (remaining >= 5 && code[2] == OP_SET_LOCAL && code[4] == OP_POP) {
+    if (code[0] == OP_GET_LOCAL) {
+      code[0] = OP_COPY_LOCAL;
+      return true;
+    }
+    if (code[0] == OP_CONSTANT) {
+      code[0] = OP_SET_LOCAL_CONSTANT;
+      return true;
+    }
+  }
+  if (code[0] != OP_GET_LOCAL || remaining < 8 || code[5] != OP_SET_LOCAL ||
+      code[7] != OP_POP) {
+    return false;
+  }
+  if (code[2] == OP_GET_LOCAL) {
+    switch (code[4]) {
+    case OP_ADD:
+      code[0] = OP_ASSIGN_ADD_LOCALS;
+      return true;
+    case OP_SUBTRACT:
+      code[0] = OP_ASSIGN_SUBTRACT_LOCALS;
+      return true;
+    case OP_MULTIPLY:
+      code[0] = OP_ASSIGN_MULTIPLY_LOCALS;
+      return true;
+    case OP_DIVIDE:
+      code[0] = OP_ASSIGN_DIVIDE_LOCALS;
+      return true;
+    default:
+      return false;
+    }
+  }
+  if (code[2] == OP_CONSTANT) {
+    switch (code[4]) {
+    case OP_ADD:
+      code[0] = OP_ASSIGN_ADD_LOCAL_CONSTANT;
+      return true;
+    case OP_SUBTRACT:
+      code[0] = OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT;
+      return true;
+    case OP_MULTIPLY:
+      code[0] = OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT;
+      return true;
+    case OP_DIVIDE:
+      code[0] = OP_ASSIGN_DIVIDE_LOCAL_CONSTANT;
+      return true;
+    default:
+      return false;
+    }
+  }
+  return false;
+}
+#endif /* ifdef FUSE_ASSIGNMENTS */
+
+/// Writes a superinstruction over the opcode at offset if the sequence that
+/// starts there is one of the fused ones.
+static void fuse_instructions(Chunk *chunk, size_t offset) {
+  uint8_t *code = &chunk->code[offset];
+  size_t remaining = chunk->count - offset;
+  // An increment such as `i := i + 1;` would also fuse as an assignment, so
+  // it is matched first.
+  if (code[0] == OP_GET_LOCAL && remaining >= 8 && code[2] == OP_CONSTANT &&
+      code[4] == OP_ADD && code[5] == OP_SET_LOCAL && code[6] == code[1] &&
+      code[7] == OP_POP) {
+    code[0] = OP_INCREMENT_LOCAL;
+    return;
+  }
+#ifdef FUSE_ASSIGNMENTS
+  if (fuse_assignment(chunk, offset)) {
+    return;
+  }
+#endif /* ifdef FUSE_ASSIGNMENTS */
+  if (code[0] != OP_GET_LOCAL || remaining < 5) {
+    return;
+  }
+  if (code[2] == OP_GET_LOCAL) {
+    switch (code[4]) {
+    case OP_ADD:
+      code[0] = OP_ADD_LOCALS;
+      break;
+    case OP_SUBTRACT:
+      code[0] = OP_SUBTRACT_LOCALS;
+      break;
+    case OP_MULTIPLY:
+      code[0] = OP_MULTIPLY_LOCALS;
+      break;
+    case OP_DIVIDE:
+      code[0] = OP_DIVIDE_LOCALS;
+      break;
+    case OP_GREATER:
+      code[0] = OP_GREATER_LOCALS;
+      break;
+    case OP_LESS:
+      code[0] = OP_LESS_LOCALS;
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      code[0] = OP_JUMP_IF_NOT_GREATER_LOCALS;
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      code[0] = OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS;
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      code[0] = OP_JUMP_IF_NOT_LESS_LOCALS;
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      code[0] = OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS;
+      break;
+    default:
+      break;
+    }
+  } else if (code[2] == OP_CONSTANT) {
+    switch (code[4]) {
+    case OP_ADD:
+      code[0] = OP_ADD_LOCAL_CONSTANT;
+      break;
+    case OP_SUBTRACT:
+      code[0] = OP_SUBTRACT_LOCAL_CONSTANT;
+      break;
+    case OP_MULTIPLY:
+      code[0] = OP_MULTIPLY_LOCAL_CONSTANT;
+      break;
+    case OP_DIVIDE:
+      code[0] = OP_DIVIDE_LOCAL_CONSTANT;
+      break;
+    case OP_GREATER:
+      code[0] = OP_GREATER_LOCAL_CONSTANT;
+      break;
+    case OP_LESS:
+      code[0] = OP_LESS_LOCAL_CONSTANT;
+      break;
+    case OP_JUMP_IF_NOT_GREATER:
+      code[0] = OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT;
+      break;
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+      code[0] = OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT;
+      break;
+    case OP_JUMP_IF_NOT_LESS:
+      code[0] = OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT;
+      break;
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      code[0] = OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT;
+      break;
+    default:
+      break;
+    }
+  }
+}
+
+/// Runs the peephole pass over a finished chunk. Dead constants and chains
+/// of jumps are rewritten first, then hot sequences are fused into
+/// superinstructions. Every rewrite keeps the length of the code, so no jump
+/// offsets or line numbers have to be relocated.
+void optimize_chunk(Chunk *chunk) {
+  bool *targets = ALLOCATE_ZEROED(bool, chunk->count);
+  find_jump_targets(chunk, targets);
+
+  for (size_t offset = 0; offset < chunk->count;
+       offset += instruction_length(chunk, offset)) {
+    if (chunk->code[offset] == OP_CONSTANT) {
+      remove_dead_constant(chunk, offset, targets);
+    }
+  }
+  for (size_t offset = 0; offset < chunk->count;
+       offset += instruction_length(chunk, offset)) {
+    uint8_t instruction = chunk->code[offset];
+    if (is_jump(instruction) && !is_backward_jump(instruction)) {
+      thread_jump(chunk, offset);
+    }
+  }
+  // The length is taken before fusing so that the scan keeps stepping over
+  // the original instructions.
+  for (size_t offset = 0; offset < chunk->count;) {
+    size_t length = instruction_length(chunk, offset);
+    fuse_instructions(chunk, offset);
+    offset += length;
+  }
+
+  FREE_ARRAY(bool, targets, chunk->count);
+}
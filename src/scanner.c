@@ -4,12 +4,6 @@
 #include <stdio.h>
 #include <string.h>
 
-typedef struct Scanner {
-  const char *start;
-  const char *current;
-  size_t line;
-} Scanner;
-
 Scanner scanner;
 
 void init_scanner(const char *source) {
@@ -18,6 +12,10 @@ void init_scanner(const char *source) {
   scanner.line = 1;
 }
 
+Scanner save_scanner() { return scanner; }
+
+void restore_scanner(Scanner saved) { scanner = saved; }
+
 static bool is_digit(char c) { return c >= '0' && c <= '9'; }
 
 static bool is_alpha(char c) {
@@ -122,7 +120,20 @@ static TokenType check_keyword(size_t start, size_t length, const char *rest,
 static TokenType identifier_type() {
   switch (scanner.start[0]) {
   case 'c':
-    return check_keyword(1, 4, "lass", TOKEN_CLASS);
+    if (scanner.current - scanner.start > 1) {
+      switch (scanner.start[1]) {
+      case 'a':
+        if (scanner.current - scanner.start > 2 && scanner.start[2] == 's') {
+          return check_keyword(3, 1, "e", TOKEN_CASE);
+        }
+        return check_keyword(2, 3, "tch", TOKEN_CATCH);
+      case 'l':
+        return check_keyword(2, 3, "ass", TOKEN_CLASS);
+      }
+    }
+    break;
+  case 'd':
+    return check_keyword(1, 6, "efault", TOKEN_DEFAULT);
   case 'e':
     return check_keyword(1, 3, "lse", TOKEN_ELSE);
   case 'i':
@@ -132,7 +143,15 @@ static TokenType identifier_type() {
   case 'r':
     return check_keyword(1, 5, "eturn", TOKEN_RETURN);
   case 's':
-    return check_keyword(1, 4, "uper", TOKEN_SUPER);
+    if (scanner.current - scanner.start > 1) {
+      switch (scanner.start[1]) {
+      case 'u':
+        return check_keyword(2, 3, "per", TOKEN_SUPER);
+      case 'w':
+        return check_keyword(2, 4, "itch", TOKEN_SWITCH);
+      }
+    }
+    break;
   case 'v':
     return check_keyword(1, 2, "ar", TOKEN_VAR);
   case 'w':
@@ -157,8 +176,14 @@ static TokenType identifier_type() {
     if (scanner.current - scanner.start > 1) {
       switch (scanner.start[1]) {
       case 'h':
+        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'r') {
+          return check_keyword(3, 2, "ow", TOKEN_THROW);
+        }
         return check_keyword(2, 2, "is", TOKEN_THIS);
       case 'r':
+        if (scanner.current - scanner.start > 2 && scanner.start[2] == 'y') {
+          return check_keyword(3, 0, "", TOKEN_TRY);
+        }
         return check_keyword(2, 2, "ue", TOKEN_TRUE);
       }
     }
@@ -274,6 +299,12 @@ Token scan_token() {
     return make_token(match('=') ? TOKEN_STAR_EQUAL : TOKEN_STAR);
   case '/':
     return make_token(match('=') ? TOKEN_SLASH_EQUAL : TOKEN_SLASH);
+  case '%':
+    return make_token(TOKEN_PERCENT);
+  case '\\':
+    return make_token(TOKEN_BACKSLASH);
+  case '^':
+    return make_token(TOKEN_CARET);
 #ifdef __unix__
   case '~':
     return file_path();
@@ -289,8 +320,14 @@ Token scan_token() {
   case '!':
     return make_token(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
   case '<':
+    if (match('<')) {
+      return make_token(TOKEN_LESS_LESS);
+    }
     return make_token(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
   case '>':
+    if (match('>')) {
+      return make_token(TOKEN_GREATER_GREATER);
+    }
     return make_token(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
   case '"':
     return string();
@@ -18,6 +18,9 @@ typedef enum TokenType {
   TOKEN_COLON,
   TOKEN_SLASH,
   TOKEN_STAR,
+  TOKEN_PERCENT,
+  TOKEN_BACKSLASH,
+  TOKEN_CARET,
 
   TOKEN_BANG,
   TOKEN_BANG_EQUAL,
@@ -27,6 +30,8 @@ typedef enum TokenType {
   TOKEN_GREATER_EQUAL,
   TOKEN_LESS,
   TOKEN_LESS_EQUAL,
+  TOKEN_LESS_LESS,
+  TOKEN_GREATER_GREATER,
 
   TOKEN_PLUS_EQUAL,
   TOKEN_MINUS_EQUAL,
@@ -39,7 +44,10 @@ typedef enum TokenType {
   TOKEN_NUMBER,
 
   TOKEN_AND,
+  TOKEN_CASE,
+  TOKEN_CATCH,
   TOKEN_CLASS,
+  TOKEN_DEFAULT,
   TOKEN_ELSE,
   TOKEN_FALSE,
   TOKEN_FOR,
@@ -50,8 +58,11 @@ typedef enum TokenType {
   TOKEN_PRIVATE,
   TOKEN_RETURN,
   TOKEN_SUPER,
+  TOKEN_SWITCH,
   TOKEN_THIS,
+  TOKEN_THROW,
   TOKEN_TRUE,
+  TOKEN_TRY,
   TOKEN_VAR,
   TOKEN_WHILE,
 
@@ -67,5 +78,15 @@ typedef struct Token {
   size_t line;
 } Token;
 
+typedef struct Scanner {
+  const char *start;
+  const char *current;
+  size_t line;
+} Scanner;
+
 void init_scanner(const char *source);
 Token scan_token();
+/// Gets the position of the scanner, so that the compiler can look ahead
+/// and rewind with restore_scanner.
+Scanner save_scanner();
+void restore_scanner(Scanner saved);
@@ -6,15 +6,29 @@
 #include <string.h>
 
 #define TABLE_MAX_LOAD 0.75
+// Tables growing to at least this many buckets are resized incrementally.
+#define TABLE_INCREMENTAL_MIN 1024
+// Number of old buckets migrated by every table mutation during a resize.
+#define TABLE_MIGRATE_STEP 32
+
+// A bucket without a key is either empty or a tombstone left by a deletion.
+// Tombstones hold `true`, which lets bucket arrays start out zero-filled.
+#define IS_TOMBSTONE(entry)                                                    \
+  (IS_BOOL((entry)->value) && AS_BOOL((entry)->value))
 
 void init_table(Table *table) {
   table->count = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->old_entries = NULL;
+  table->old_capacity = 0;
+  table->old_count = 0;
+  table->migrated = 0;
 }
 
 void free_table(Table *table) {
   FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(Entry, table->old_entries, table->old_capacity);
   init_table(table);
 }
 
@@ -24,7 +38,7 @@ static Entry *find_entry(Entry *entries, size_t capacity, ObjString *key) {
   for (;;) {
     Entry *entry = &entries[index];
     if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
+      if (!IS_TOMBSTONE(entry)) {
         return tombstone != NULL ? tombstone : entry;
       } else {
         if (tombstone == NULL) {
@@ -38,25 +52,112 @@ static Entry *find_entry(Entry *entries, size_t capacity, ObjString *key) {
   }
 }
 
+/// Finds the entry holding key in the array that is still being migrated.
+///
+/// Returns:
+///   The entry, or NULL if no resize is in progress or the key was already
+///   migrated (or never present).
+static Entry *find_old_entry(Table *table, ObjString *key) {
+  if (table->old_entries == NULL) {
+    return NULL;
+  }
+  Entry *entry = find_entry(table->old_entries, table->old_capacity, key);
+  return entry->key == NULL ? NULL : entry;
+}
+
+/// Moves up to budget buckets from the old entry array into the new one.
+/// Migrated buckets are left behind as tombstones so that probe sequences for
+/// keys which have not been migrated yet stay intact. The old array is freed
+/// once every bucket has been visited.
+static void migrate_entries(Table *table, size_t budget) {
+  while (budget > 0 && table->migrated < table->old_capacity) {
+    Entry *entry = &table->old_entries[table->migrated++];
+    budget--;
+    if (entry->key == NULL && !IS_TOMBSTONE(entry)) {
+      continue;
+    }
+    table->old_count--;
+    if (entry->key == NULL) {
+      continue;
+    }
+    Entry *dest = find_entry(table->entries, table->capacity, entry->key);
+    if (dest->key == NULL && !IS_TOMBSTONE(dest)) {
+      table->count++;
+    }
+    dest->key = entry->key;
+    dest->value = entry->value;
+    entry->key = NULL;
+    entry->value = BOOL_VAL(true);
+  }
+  if (table->migrated == table->old_capacity) {
+    FREE_ARRAY(Entry, table->old_entries, table->old_capacity);
+    table->old_entries = NULL;
+    table->old_capacity = 0;
+    table->old_count = 0;
+    table->migrated = 0;
+  }
+}
+
 bool table_get(Table *table, ObjString *key, Value *value) {
-  if (table->count == 0) {
+  if (table->count == 0 && table->old_entries == NULL) {
     return false;
   }
 
   Entry *entry = find_entry(table->entries, table->capacity, key);
   if (entry->key == NULL) {
+    entry = find_old_entry(table, key);
+    if (entry == NULL) {
+      return false;
+    }
+  }
+
+  *value = entry->value;
+  return true;
+}
+
+/// Looks up key like table_get, and also reports the bucket it was found in
+/// so that callers can cache it.
+///
+/// Returns:
+///   true if key is present. slot is set to the index of its bucket in
+///   entries, or to capacity if the key is still in old_entries.
+bool table_get_slot(Table *table, ObjString *key, Value *value, size_t *slot) {
+  if (table->count == 0 && table->old_entries == NULL) {
     return false;
   }
 
+  Entry *entry = find_entry(table->entries, table->capacity, key);
+  if (entry->key != NULL) {
+    *slot = (size_t)(entry - table->entries);
+  } else {
+    entry = find_old_entry(table, key);
+    if (entry == NULL) {
+      return false;
+    }
+    *slot = table->capacity;
+  }
+
   *value = entry->value;
   return true;
 }
 
 static void adjust_capacity(Table *table, size_t capacity) {
-  Entry *entries = ALLOCATE(Entry, capacity);
-  for (size_t i = 0; i < capacity; ++i) {
-    entries[i].key = NULL;
-    entries[i].value = NIL_VAL;
+  if (table->old_entries != NULL) {
+    migrate_entries(table, table->old_capacity);
+  }
+  // Zero-filled memory is handed out lazily by the system allocator, so large
+  // arrays do not pay for an upfront fill either.
+  Entry *entries = ALLOCATE_ZEROED(Entry, capacity);
+  if (capacity >= TABLE_INCREMENTAL_MIN) {
+    // Keep the current entries live and migrate them a few at a time.
+    table->old_entries = table->entries;
+    table->old_capacity = table->capacity;
+    table->old_count = table->count;
+    table->migrated = 0;
+    table->entries = entries;
+    table->capacity = capacity;
+    table->count = 0;
+    return;
   }
   table->count = 0;
   for (size_t i = 0; i < table->capacity; ++i) {
@@ -76,13 +177,24 @@ static void adjust_capacity(Table *table, size_t capacity) {
 }
 
 bool table_set(Table *table, ObjString *key, Value value) {
-  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+  if (table->old_entries != NULL) {
+    migrate_entries(table, TABLE_MIGRATE_STEP);
+  }
+  if (table->count + table->old_count + 1 > table->capacity * TABLE_MAX_LOAD) {
     size_t capacity = GROW_CAPACITY(table->capacity);
     adjust_capacity(table, capacity);
   }
   Entry *entry = find_entry(table->entries, table->capacity, key);
   bool is_new_key = entry->key == NULL;
-  if (is_new_key && IS_NIL(entry->value)) {
+  if (is_new_key) {
+    Entry *old = find_old_entry(table, key);
+    if (old != NULL) {
+      old->key = NULL;
+      old->value = BOOL_VAL(true);
+      is_new_key = false;
+    }
+  }
+  if (entry->key == NULL && !IS_TOMBSTONE(entry)) {
     table->count++;
   }
   entry->key = key;
@@ -91,19 +203,33 @@ bool table_set(Table *table, ObjString *key, Value value) {
 }
 
 bool table_delete(Table *table, ObjString *key) {
-  if (table->count == 0) {
+  if (table->count == 0 && table->old_entries == NULL) {
     return false;
   }
 
   Entry *entry = find_entry(table->entries, table->capacity, key);
   if (entry->key == NULL) {
-    return false;
+    entry = find_old_entry(table, key);
+    if (entry == NULL) {
+      return false;
+    }
   }
   entry->key = NULL;
   entry->value = BOOL_VAL(true);
   return true;
 }
 
+/// Grows a table up front so that it can hold count keys without resizing.
+void table_reserve(Table *table, size_t count) {
+  size_t capacity = table->capacity;
+  while (count > capacity * TABLE_MAX_LOAD) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  if (capacity != table->capacity) {
+    adjust_capacity(table, capacity);
+  }
+}
+
 void table_add_all(Table *from, Table *to) {
   for (size_t i = 0; i < from->capacity; ++i) {
     Entry *entry = &from->entries[i];
@@ -111,41 +237,112 @@ void table_add_all(Table *from, Table *to) {
       table_set(to, entry->key, entry->value);
     }
   }
+  for (size_t i = from->migrated; i < from->old_capacity; ++i) {
+    Entry *entry = &from->old_entries[i];
+    if (entry->key != NULL) {
+      table_set(to, entry->key, entry->value);
+    }
+  }
 }
 
-ObjString *table_find_string(Table *table, const char *chars, size_t length,
-                             uint32_t hash) {
-  if (table->count == 0) {
-    return NULL;
+void mark_table(Table *table) {
+  for (size_t i = 0; i < table->capacity; ++i) {
+    Entry *entry = &table->entries[i];
+    mark_object((Obj *)entry->key);
+    mark_value(entry->value);
   }
-  uint32_t index = hash & (table->capacity - 1);
-  for (;;) {
-    Entry *entry = &table->entries[index];
-    if (entry->key == NULL) {
-      if (IS_NIL(entry->value)) {
-        return NULL;
-      }
-    } else if (entry->key->length == length && entry->key->hash == hash &&
-               memcmp(entry->key->chars, chars, length) == 0) {
-      return entry->key;
+  for (size_t i = table->migrated; i < table->old_capacity; ++i) {
+    Entry *entry = &table->old_entries[i];
+    mark_object((Obj *)entry->key);
+    mark_value(entry->value);
+  }
+}
+
+void init_method_table(MethodTable *table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void free_method_table(MethodTable *table) {
+  FREE_ARRAY(MethodEntry, table->entries, table->capacity);
+  init_method_table(table);
+}
+
+/// Finds the position of symbol in a method table.
+///
+/// Returns:
+///   The index of the entry for symbol, or the index it would be inserted at
+///   if the table has no such entry.
+static size_t find_method(MethodTable *table, uint32_t symbol) {
+  size_t low = 0;
+  size_t high = table->count;
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    if (table->entries[middle].symbol < symbol) {
+      low = middle + 1;
+    } else {
+      high = middle;
     }
-    index = (index + 1) & (table->capacity - 1);
   }
+  return low;
 }
 
-void table_remove_white(Table *table) {
-  for (size_t i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    if (entry->key != NULL && !entry->key->obj.is_marked) {
-      table_delete(table, entry->key);
+bool method_table_get(MethodTable *table, uint32_t symbol, Value *method) {
+  size_t index = find_method(table, symbol);
+  if (index == table->count || table->entries[index].symbol != symbol) {
+    return false;
+  }
+  *method = table->entries[index].method;
+  return true;
+}
+
+static void reserve_methods(MethodTable *table, size_t count) {
+  if (table->capacity >= count) {
+    return;
+  }
+  size_t old_capacity = table->capacity;
+  table->capacity = GROW_CAPACITY(old_capacity);
+  if (table->capacity < count) {
+    table->capacity = count;
+  }
+  table->entries = GROW_ARRAY(MethodEntry, table->entries, old_capacity,
+                              table->capacity);
+}
+
+void method_table_set(MethodTable *table, uint32_t symbol, Value method) {
+  size_t index = find_method(table, symbol);
+  if (index < table->count && table->entries[index].symbol == symbol) {
+    table->entries[index].method = method;
+    return;
+  }
+  reserve_methods(table, table->count + 1);
+  memmove(&table->entries[index + 1], &table->entries[index],
+          sizeof(MethodEntry) * (table->count - index));
+  table->entries[index].symbol = symbol;
+  table->entries[index].method = method;
+  table->count++;
+}
+
+/// Copies every method of from into to, replacing methods with the same
+/// symbol. Inheriting into a class without methods, the usual case, is a
+/// single copy of the sorted entries.
+void method_table_add_all(MethodTable *from, MethodTable *to) {
+  if (to->count == 0) {
+    reserve_methods(to, from->count);
+    if (from->count != 0) {
+      memcpy(to->entries, from->entries, sizeof(MethodEntry) * from->count);
     }
+    to->count = from->count;
+    return;
+  }
+  for (size_t i = 0; i < from->count; ++i) {
+    method_table_set(to, from->entries[i].symbol, from->entries[i].method);
   }
 }
 
-void mark_table(Table *table) {
-  for (size_t i = 0; i < table->capacity; ++i) {
-    Entry *entry = &table->entries[i];
-    mark_object((Obj *)entry->key);
-    mark_value(entry->value);
+void mark_method_table(MethodTable *table) {
+  for (size_t i = 0; i < table->count; ++i) {
+    mark_value(table->entries[i].method);
   }
 }
@@ -9,19 +9,46 @@ typedef struct Entry {
   Value value;
 } Entry;
 
+/// While a large table is being resized both the old and the new entry arrays
+/// stay live. Every mutation migrates a bounded number of old buckets, so no
+/// single insert pays for rehashing the whole table.
 typedef struct Table {
   size_t count;
   size_t capacity;
   Entry *entries;
+  Entry *old_entries;  ///< Entries still being migrated, or NULL.
+  size_t old_capacity; ///< Capacity of old_entries.
+  size_t old_count;    ///< Occupied buckets left to migrate in old_entries.
+  size_t migrated;     ///< Index of the next old bucket to migrate.
 } Table;
 
 void init_table(Table *table);
 void free_table(Table *table);
 bool table_get(Table *table, ObjString *key, Value *value);
+bool table_get_slot(Table *table, ObjString *key, Value *value, size_t *slot);
 bool table_set(Table *table, ObjString *key, Value value);
 bool table_delete(Table *table, ObjString *key);
 void table_add_all(Table *from, Table *to);
-ObjString *table_find_string(Table *table, const char *chars, size_t length,
-                             uint32_t hash);
-void table_remove_white(Table *table);
+void table_reserve(Table *table, size_t count);
 void mark_table(Table *table);
+
+/// Method tables map symbols, the dense integer ids given to identifiers when
+/// they are compiled, to methods. Entries are kept sorted by symbol so a
+/// lookup is a short binary search and copying a whole table is a memcpy.
+typedef struct MethodEntry {
+  uint32_t symbol;
+  Value method;
+} MethodEntry;
+
+typedef struct MethodTable {
+  size_t count;
+  size_t capacity;
+  MethodEntry *entries;
+} MethodTable;
+
+void init_method_table(MethodTable *table);
+void free_method_table(MethodTable *table);
+bool method_table_get(MethodTable *table, uint32_t symbol, Value *method);
+void method_table_set(MethodTable *table, uint32_t symbol, Value method);
+void method_table_add_all(MethodTable *from, MethodTable *to);
+void mark_method_table(MethodTable *table);
@@ -9,11 +9,20 @@
 
 bool values_equal(Value a, Value b) {
 #ifdef NAN_BOXING
+  if (IS_INT(a) && IS_INT(b)) {
+    return a == b;
+  }
   if (IS_NUMBER(a) && IS_NUMBER(b)) {
     return AS_NUMBER(a) == AS_NUMBER(b);
   }
-  return a == b;
+  if (a == b) {
+    return true;
+  }
+  return IS_TUPLE(a) && IS_TUPLE(b) && tuples_equal(AS_TUPLE(a), AS_TUPLE(b));
 #else
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    return AS_NUMBER(a) == AS_NUMBER(b);
+  }
   if (a.type != b.type) {
     return false;
   }
@@ -22,10 +31,12 @@ bool values_equal(Value a, Value b) {
     return AS_BOOL(a) == AS_BOOL(b);
   case VAL_NIL:
     return true;
-  case VAL_NUMBER:
-    return AS_NUMBER(a) == AS_NUMBER(b);
   case VAL_OBJ:
-    return AS_OBJ(a) == AS_OBJ(b);
+    if (AS_OBJ(a) == AS_OBJ(b)) {
+      return true;
+    }
+    return IS_TUPLE(a) && IS_TUPLE(b) &&
+           tuples_equal(AS_TUPLE(a), AS_TUPLE(b));
   default:
     return false;
   }
@@ -72,6 +83,7 @@ void print_value(Value value) {
   case VAL_NIL:
     printf("nil");
     break;
+  case VAL_INT:
   case VAL_NUMBER:
     printf("%g", AS_NUMBER(value));
     break;
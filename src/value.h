@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include <math.h>
 #include <string.h>
 
 typedef struct Obj Obj;
@@ -13,22 +14,27 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1
 #define TAG_FALSE 2
 #define TAG_TRUE 3
+// Integers are held in the low 32 bits of a quiet NaN with this bit set.
+#define TAG_INT ((uint64_t)0x0001000000000000)
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value) ((value | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) >> 32) == ((QNAN | TAG_INT) >> 32))
+#define IS_DOUBLE(value) (((value) & QNAN) != QNAN)
 #define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
-#define AS_NUMBER(value) value_to_num(value)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
+#define AS_DOUBLE(value) value_to_num(value)
 #define AS_OBJ(value) ((Obj *)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
 
 #define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define INT_VAL(i) ((Value)(QNAN | TAG_INT | (uint32_t)(int32_t)(i)))
 #define NUMBER_VAL(num) num_to_value(num)
 #define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uintptr_t)(obj))
 
@@ -46,12 +52,19 @@ static inline Value num_to_value(double num) {
 
 #else
 
-typedef enum ValueType { VAL_BOOL, VAL_NIL, VAL_NUMBER, VAL_OBJ } ValueType;
+typedef enum ValueType {
+  VAL_BOOL,
+  VAL_NIL,
+  VAL_INT,
+  VAL_NUMBER,
+  VAL_OBJ
+} ValueType;
 
 typedef struct Value {
   ValueType type;
   union {
     bool boolean;
+    int32_t integer;
     double number;
     Obj *obj;
   } as;
@@ -59,19 +72,52 @@ typedef struct Value {
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_DOUBLE(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_DOUBLE(value) ((value).as.number)
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
+#define FALSE_VAL BOOL_VAL(false)
+#define TRUE_VAL BOOL_VAL(true)
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj *)object}})
 #endif
 
+// Numbers are either integers or doubles. Scripts cannot tell the two apart:
+// AS_NUMBER reads either one as a double, and arithmetic on integers only
+// stays in integers while the result fits.
+#define IS_NUMBER(value) (IS_INT(value) || IS_DOUBLE(value))
+#define AS_NUMBER(value) number_to_double(value)
+
+static inline double number_to_double(Value value) {
+  return IS_INT(value) ? (double)AS_INT(value) : AS_DOUBLE(value);
+}
+
+/// Boxes the result of integer arithmetic, as a double if it does not fit
+/// in an integer.
+static inline Value int64_to_value(int64_t number) {
+  if (LIKELY(number >= INT32_MIN && number <= INT32_MAX)) {
+    return INT_VAL((int32_t)number);
+  }
+  return NUMBER_VAL((double)number);
+}
+
+/// Boxes a double as an integer if it holds one exactly.
+static inline Value double_to_value(double number) {
+  if (number >= INT32_MIN && number <= INT32_MAX &&
+      number == (double)(int32_t)number && !(number == 0 && signbit(number))) {
+    return INT_VAL((int32_t)number);
+  }
+  return NUMBER_VAL(number);
+}
+
 typedef struct {
   size_t capacity;
   size_t count;
@@ -6,6 +6,7 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include <math.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -15,8 +16,18 @@
 #include <string.h>
 #include <time.h>
 
+// Labels as values are a GNU extension, other compilers use the switch.
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
 VM vm;
-/// Native function for finding the length of an array/string.
+#ifdef COMPUTED_GOTO
+// The address of the handler for each opcode, which run() hands over when
+// it is called without any frames.
+static void **opcode_handlers;
+#endif /* ifdef COMPUTED_GOTO */
+/// Native function for finding the length of an array/string/tuple.
 ///
 /// Parameters:
 ///   arg_count: The number of arguments (should be 1).
@@ -24,12 +35,15 @@ VM vm;
 ///   function.
 ///
 /// Returns:
-///   A new value representing the length of the array/string, otherwise nil.
+///   A new value representing the length of the array/string/tuple, otherwise
+///   nil.
 static Value length_native(size_t arg_count, Value *args) {
   if (IS_ARRAY(args[0])) {
-    return NUMBER_VAL((double)(AS_ARRAY(args[0])->length));
+    return int64_to_value((int64_t)AS_ARRAY(args[0])->length);
   } else if (IS_STRING(args[0])) {
-    return NUMBER_VAL((double)(AS_STRING(args[0])->length));
+    return int64_to_value((int64_t)AS_STRING(args[0])->length);
+  } else if (IS_TUPLE(args[0])) {
+    return int64_to_value((int64_t)AS_TUPLE(args[0])->length);
   } else {
     return NIL_VAL;
   }
@@ -64,27 +78,74 @@ static void reset_stack() {
   vm.frame_count = 0;
   vm.open_upvalues = NULL;
 }
-/// Handles runtime errors, printing an error message with formatted output to
-/// stderr. Also displays file, line, and function information for the error.
+/// Closes the upvalues that are no longer in scope.
 ///
 /// Parameters:
-///   format: The format string for the error message.
-///   ...: Variable arguments for the format string.
-static void runtime_error(const char *format, ...) {
-  // prints an error message with formated output to stderr.
-  va_list args;
-  va_start(args, format);
-  vfprintf(stderr, format, args);
-  va_end(args);
+///   last: A pointer to the top of the stack, indicating the last value still
+///   in scope.
+static void close_upvalue(Value *last) {
+  while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
+    ObjUpvalue *upvalue = vm.open_upvalues;
+    upvalue->closed = *upvalue->location;
+    upvalue->location = &upvalue->closed;
+    vm.open_upvalues = upvalue->next;
+  }
+}
+/// Throws exception from the instruction the innermost frame is executing.
+/// The first frame whose instruction is inside a try block discards the
+/// frames above it and carries on at the catch block, with the stack unwound
+/// to the depth of the try block and the exception pushed on top. Nothing is
+/// done on entry to a try block, so handlers are only looked up here.
+///
+/// An exception that nothing catches is printed to stderr along with the
+/// file, line, and function of every frame, and the stack is reset.
+///
+/// Parameters:
+///   exception: The value being thrown.
+///
+/// Returns:
+///   true if a catch block will handle the exception.
+static bool throw_value(Value exception) {
+  for (ssize_t i = vm.frame_count - 1; i >= 0; i--) {
+    CallFrame *frame = &vm.frames[i];
+    ObjFunction *function = frame->closure->function;
+    ExceptionHandler *handler = chunk_handler(
+        &function->chunk, (size_t)(frame->ip - function->code - 1));
+    if (handler == NULL) {
+      continue;
+    }
+    close_upvalue(frame->slots + handler->depth);
+    vm.stack_top = frame->slots + handler->depth;
+    push(exception);
+    frame->ip = function->code + handler->handler;
+    vm.frame_count = i + 1;
+    return true;
+  }
+
+  if (IS_STRING(exception)) {
+    fputs(AS_CSTRING(exception), stderr);
+  } else {
+    fputs("Uncaught exception.", stderr);
+  }
   fputs("\n", stderr);
 
   // Displays file, line, and function information for the error.
+  size_t omitted = vm.frame_count > 2 * TRACE_FRAMES_SHOWN
+                       ? vm.frame_count - 2 * TRACE_FRAMES_SHOWN
+                       : 0;
   for (ssize_t i = vm.frame_count - 1; i >= 0; i--) {
+    if (omitted > 0 && (size_t)i == vm.frame_count - 1 - TRACE_FRAMES_SHOWN) {
+      fprintf(stderr, "... %zu frames omitted ...\n", omitted);
+      i = TRACE_FRAMES_SHOWN;
+      continue;
+    }
     CallFrame *frame = &vm.frames[i];
     ObjFunction *function = frame->closure->function;
-    size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[file %s, line %zu] in ", vm.path,
-            function->chunk.lines[instruction]);
+    size_t instruction = frame->ip - function->code - 1;
+    Value path = chunk_path(&function->chunk, instruction);
+    fprintf(stderr, "[file %s, line %zu] in ",
+            IS_STRING(path) ? AS_CSTRING(path) : "?",
+            chunk_line(&function->chunk, instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
@@ -93,6 +154,24 @@ static void runtime_error(const char *format, ...) {
   }
 
   reset_stack();
+  return false;
+}
+/// Handles runtime errors by throwing the formatted error message as a
+/// string, which a catch block can handle like any other exception.
+///
+/// Parameters:
+///   format: The format string for the error message.
+///   ...: Variable arguments for the format string.
+static void runtime_error(const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  char *message = ALLOCATE(char, length + 1);
+  va_start(args, format);
+  vsnprintf(message, length + 1, format, args);
+  va_end(args);
+  throw_value(OBJ_VAL(take_string(message, length)));
 }
 /// Defines a native function in the VM's global table.
 ///
@@ -108,9 +187,50 @@ static void define_native(const char *name, NativeFn function) {
   pop();
   pop();
 }
+/// Chooses the seed for string hashing. SALMON_HASH_SEED may pin it to a
+/// fixed value for reproducible runs, otherwise it is read from the system's
+/// random source, falling back to the clock and address space layout.
+///
+/// Returns:
+///   The seed for hash_string.
+static uint64_t make_hash_seed() {
+  const char *fixed = getenv("SALMON_HASH_SEED");
+  if (fixed != NULL) {
+    return strtoull(fixed, NULL, 10);
+  }
+  uint64_t seed = 0;
+  FILE *random = fopen("/dev/urandom", "rb");
+  if (random != NULL) {
+    size_t bytes_read = fread(&seed, sizeof(seed), 1, random);
+    fclose(random);
+    if (bytes_read == 1) {
+      return seed;
+    }
+  }
+  seed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32);
+  seed ^= (uint64_t)(uintptr_t)&seed;
+  return seed;
+}
+/// Reads a stack limit from the environment.
+///
+/// Returns:
+///   The value of the variable name if it is set to a positive number,
+///   otherwise fallback.
+static size_t limit_from_env(const char *name, size_t fallback) {
+  const char *value = getenv(name);
+  if (value == NULL) {
+    return fallback;
+  }
+  size_t limit = strtoull(value, NULL, 10);
+  return limit > 0 ? limit : fallback;
+}
 /// Initializes the virtual machine, resetting the stack and initializing
 /// various VM components.
 void init_VM() {
+  vm.frames = NULL;
+  vm.frame_capacity = 0;
+  vm.stack = NULL;
+  vm.stack_capacity = 0;
   reset_stack();
   vm.objects = NULL;
   vm.bytes_allocated = 0;
@@ -119,10 +239,22 @@ void init_VM() {
   vm.gray_count = 0;
   vm.gray_stack = NULL;
   init_table(&vm.globals);
-  init_table(&vm.strings);
+  init_intern_set(&vm.strings);
+  init_value_array(&vm.symbols);
+  init_value_array(&vm.index_strings);
+  vm.hash_seed = make_hash_seed();
+
+  vm.frames_max = limit_from_env("SALMON_FRAMES_MAX", FRAMES_MAX);
+  vm.stack_max = limit_from_env("SALMON_STACK_MAX", STACK_MAX);
+  vm.frames = ALLOCATE(CallFrame, FRAMES_INITIAL);
+  vm.frame_capacity = FRAMES_INITIAL;
+  vm.stack = ALLOCATE(Value, STACK_INITIAL);
+  vm.stack_capacity = STACK_INITIAL;
+  reset_stack();
 
   vm.init_string = NULL;
   vm.init_string = copy_string("init", 4, false);
+  symbol_for(vm.init_string);
 
   define_native("_length", length_native);
   define_native("_clock", clock_native);
@@ -133,9 +265,18 @@ void init_VM() {
 /// and string tables.
 void free_VM() {
   free_table(&vm.globals);
-  free_table(&vm.strings);
+  free_intern_set(&vm.strings);
+  free_value_array(&vm.symbols);
+  free_value_array(&vm.index_strings);
   vm.init_string = NULL;
+  FREE_ARRAY(CallFrame, vm.frames, vm.frame_capacity);
+  FREE_ARRAY(Value, vm.stack, vm.stack_capacity);
+  vm.frame_capacity = 0;
+  vm.stack_capacity = 0;
   free_objects();
+#ifdef DEBUG_OPCODE_PAIRS
+  print_opcode_pairs();
+#endif /* ifdef DEBUG_OPCODE_PAIRS */
 }
 /// Pushes a value onto the VM's stack.
 ///
@@ -161,6 +302,228 @@ Value pop() {
 /// Returns:
 ///   The value at the specified distance from the top of the stack.
 static Value peek(int distance) { return vm.stack_top[-1 - distance]; }
+/// Grows the stack to hold needed values. Frame slots and open upvalues
+/// point into the stack, so they are moved along with it.
+///
+/// Returns:
+///   false if the stack would grow past its limit, after reporting a stack
+///   overflow.
+NOINLINE static bool grow_stack(size_t needed) {
+  if (needed > vm.stack_max) {
+    runtime_error("Stack overflow.");
+    return false;
+  }
+  size_t capacity = vm.stack_capacity;
+  while (capacity < needed) {
+    capacity = GROW_CAPACITY(capacity);
+  }
+  if (capacity > vm.stack_max) {
+    capacity = vm.stack_max;
+  }
+  Value *old = vm.stack;
+  vm.stack = GROW_ARRAY(Value, vm.stack, vm.stack_capacity, capacity);
+  vm.stack_capacity = capacity;
+  vm.stack_top = vm.stack + (vm.stack_top - old);
+  for (size_t i = 0; i < vm.frame_count; ++i) {
+    vm.frames[i].slots = vm.stack + (vm.frames[i].slots - old);
+  }
+  for (ObjUpvalue *upvalue = vm.open_upvalues; upvalue != NULL;
+       upvalue = upvalue->next) {
+    upvalue->location = vm.stack + (upvalue->location - old);
+  }
+  return true;
+}
+/// Grows the array of call frames, up to its limit.
+///
+/// Returns:
+///   false if the frames are already at their limit, after reporting a stack
+///   overflow.
+NOINLINE static bool grow_frames() {
+  if (vm.frame_capacity >= vm.frames_max) {
+    runtime_error("Stack overflow.");
+    return false;
+  }
+  size_t capacity = GROW_CAPACITY(vm.frame_capacity);
+  if (capacity > vm.frames_max) {
+    capacity = vm.frames_max;
+  }
+  vm.frames = GROW_ARRAY(CallFrame, vm.frames, vm.frame_capacity, capacity);
+  vm.frame_capacity = capacity;
+  return true;
+}
+/// Makes room for count more values above the top of the stack, and for the
+/// temporaries the VM pushes on top of those.
+static bool reserve_stack(size_t count) {
+  size_t needed = (size_t)(vm.stack_top - vm.stack) + count + STACK_TEMPORARIES;
+  return needed <= vm.stack_capacity || grow_stack(needed);
+}
+/// Reads the two-byte operand that starts at code.
+static inline size_t short_operand(const uint8_t *code) {
+  return (size_t)code[0] << 8 | code[1];
+}
+/// Decodes the chunk of function into the code run() executes. The words a
+/// superinstruction covers are decoded as the instructions it replaced, and
+/// it reads its operands from those.
+///
+/// Returns:
+///   The decoded code, which is kept with the function.
+NOINLINE static Instruction *decode_function(ObjFunction *function) {
+  Chunk *chunk = &function->chunk;
+  const uint8_t *bytes = chunk->code;
+  Value *constants = chunk->constants.value;
+  Instruction *code = ALLOCATE(Instruction, chunk->count);
+  size_t offset = 0;
+  while (offset < chunk->count) {
+    uint8_t opcode = bytes[offset];
+    size_t length = instruction_length(chunk, offset);
+#ifdef COMPUTED_GOTO
+    code[offset].handler = opcode_handlers[opcode];
+#else
+    code[offset].operand = opcode;
+#endif /* ifdef COMPUTED_GOTO */
+    for (size_t i = 1; i < length; ++i) {
+      code[offset + i].operand = bytes[offset + i];
+    }
+    Instruction *operands = &code[offset + 1];
+    switch (opcode) {
+    case OP_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_PROPERTY:
+    case OP_SET_PROPERTY:
+    case OP_GET_SUPER:
+    case OP_INVOKE:
+    case OP_SUPER_INVOKE:
+    case OP_TAIL_INVOKE:
+    case OP_SUPER_TAIL_INVOKE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_PRIVATE_METHOD:
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_GET_PROPERTY_LONG:
+    case OP_SET_PROPERTY_LONG:
+    case OP_GET_SUPER_LONG:
+    case OP_INVOKE_LONG:
+    case OP_SUPER_INVOKE_LONG:
+    case OP_TAIL_INVOKE_LONG:
+    case OP_SUPER_TAIL_INVOKE_LONG:
+    case OP_CLASS_LONG:
+    case OP_METHOD_LONG:
+    case OP_PRIVATE_METHOD_LONG:
+      operands[0].constant = &constants[constant_operand(chunk, offset)];
+      break;
+    case OP_CLOSURE:
+    case OP_CLOSURE_LONG: {
+      operands[0].constant = &constants[constant_operand(chunk, offset)];
+      // Each capture is a flags byte followed by a one or two-byte index.
+      size_t capture = opcode == OP_CLOSURE_LONG ? 3 : 2;
+      while (capture < length) {
+        if (bytes[offset + capture] & CAPTURE_LONG) {
+          code[offset + capture + 1].operand =
+              short_operand(&bytes[offset + capture + 1]);
+          capture += 3;
+        } else {
+          capture += 2;
+        }
+      }
+      break;
+    }
+    case OP_GET_LOCAL_LONG:
+    case OP_SET_LOCAL_LONG:
+    case OP_GET_UPVALUE_LONG:
+    case OP_SET_UPVALUE_LONG:
+    case OP_GET_FLAT_UPVALUE_LONG:
+    case OP_SWITCH:
+      operands[0].operand = short_operand(&bytes[offset + 1]);
+      break;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL:
+      operands[0].target =
+          &code[offset + length + short_operand(&bytes[offset + 1])];
+      break;
+    case OP_LOOP:
+      operands[0].target =
+          &code[offset + length - short_operand(&bytes[offset + 1])];
+      break;
+    case OP_FORPREP:
+      // slot limit flags jump
+      if (bytes[offset + 3] & FOR_LIMIT_CONSTANT) {
+        operands[1].constant = &constants[bytes[offset + 2]];
+      }
+      operands[3].target =
+          &code[offset + length + short_operand(&bytes[offset + 4])];
+      break;
+    case OP_FORLOOP:
+      // slot limit step flags jump
+      if (bytes[offset + 4] & FOR_LIMIT_CONSTANT) {
+        operands[1].constant = &constants[bytes[offset + 2]];
+      }
+      operands[2].constant = &constants[bytes[offset + 3]];
+      operands[4].target =
+          &code[offset + length - short_operand(&bytes[offset + 5])];
+      break;
+    case OP_SET_LOCAL_CONSTANT:
+      operands[0].constant = &constants[bytes[offset + 1]];
+      length = 2;
+      break;
+    case OP_INCREMENT_LOCAL:
+    case OP_ADD_LOCALS:
+    case OP_SUBTRACT_LOCALS:
+    case OP_MULTIPLY_LOCALS:
+    case OP_DIVIDE_LOCALS:
+    case OP_GREATER_LOCALS:
+    case OP_LESS_LOCALS:
+    case OP_ADD_LOCAL_CONSTANT:
+    case OP_SUBTRACT_LOCAL_CONSTANT:
+    case OP_MULTIPLY_LOCAL_CONSTANT:
+    case OP_DIVIDE_LOCAL_CONSTANT:
+    case OP_GREATER_LOCAL_CONSTANT:
+    case OP_LESS_LOCAL_CONSTANT:
+    case OP_JUMP_IF_NOT_GREATER_LOCALS:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS:
+    case OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT:
+    case OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT:
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT:
+    case OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT:
+    case OP_COPY_LOCAL:
+    case OP_ASSIGN_ADD_LOCALS:
+    case OP_ASSIGN_SUBTRACT_LOCALS:
+    case OP_ASSIGN_MULTIPLY_LOCALS:
+    case OP_ASSIGN_DIVIDE_LOCALS:
+    case OP_ASSIGN_ADD_LOCAL_CONSTANT:
+    case OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT:
+    case OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT:
+    case OP_ASSIGN_DIVIDE_LOCAL_CONSTANT:
+      // The GET_LOCAL slot the sequence starts with.
+      length = 2;
+      break;
+    default:
+      break;
+    }
+    offset += length;
+  }
+  function->code = code;
+  return code;
+}
+/// Gets the code run() executes for function, decoding it on the first call.
+static inline Instruction *function_code(ObjFunction *function) {
+  if (LIKELY(function->code != NULL)) {
+    return function->code;
+  }
+  return decode_function(function);
+}
 /// Calls a closure with the specified number of arguments.
 ///
 /// Parameters:
@@ -177,14 +540,18 @@ static bool call(ObjClosure *closure, size_t arg_count) {
     return false;
   }
   // check for stack overflow
-  if (vm.frame_count == FRAMES_MAX) {
-    runtime_error("Stack overflow.");
+  if (vm.frame_count == vm.frame_capacity && !grow_frames()) {
     return false;
   }
+  if (!reserve_stack(closure->function->max_stack - arg_count - 1)) {
+    return false;
+  }
+  // Decoding may collect garbage, so it is done before the frame is in use.
+  Instruction *code = function_code(closure->function);
   // creates a call frame for the closure
   CallFrame *frame = &vm.frames[vm.frame_count++];
   frame->closure = closure;
-  frame->ip = closure->function->chunk.code;
+  frame->ip = code;
   frame->slots = vm.stack_top - arg_count - 1;
   return true;
 }
@@ -207,10 +574,13 @@ static bool call_value(Value callee, size_t arg_count) {
     }
     case OBJ_CLASS: {
       ObjClass *class = AS_CLASS(callee);
-      vm.stack_top[-arg_count - 1] = OBJ_VAL(new_instance(class));
-      Value initializer;
-      if (table_get(&class->methods, vm.init_string, &initializer)) {
-        return call(AS_CLOSURE(initializer), arg_count);
+      ObjInstance *instance = new_instance(class);
+      vm.stack_top[-arg_count - 1] = OBJ_VAL(instance);
+      // Size the fields for what earlier instances ended up with so that
+      // `init` does not regrow the table field by field.
+      table_reserve(&instance->fields, class->field_hint);
+      if (class->initializer != NULL) {
+        return call(class->initializer, arg_count);
       } else if (arg_count != 0) {
         runtime_error("Expected 0 arguments but got %d.", arg_count);
         return false;
@@ -233,6 +603,21 @@ static bool call_value(Value callee, size_t arg_count) {
   runtime_error("Can only call functions and classes.");
   return false;
 }
+/// Looks up a method of a class, which may be a private one when it is
+/// invoked on `this`.
+///
+/// Returns:
+///   false if the class has no such method, after reporting an error.
+static bool find_method(ObjClass *class, ObjString *name, bool is_this,
+                        Value *method) {
+  if (!method_table_get(&class->methods, name->symbol, method) &&
+      !(is_this &&
+        method_table_get(&class->private_methods, name->symbol, method))) {
+    runtime_error("Undefined property '%s'.", name->chars);
+    return false;
+  }
+  return true;
+}
 /// Invokes a method on a class with the specified method name and number of
 /// arguments.
 ///
@@ -247,39 +632,51 @@ static bool call_value(Value callee, size_t arg_count) {
 static bool invoke_from_class(ObjClass *class, ObjString *name,
                               size_t arg_count, bool is_this) {
   Value method;
-  if (!table_get(&class->methods, name, &method) &&
-      !(is_this && table_get(&class->private_methods, name, &method))) {
-    runtime_error("Undefined property '%s'.", name->chars);
+  if (!find_method(class, name, is_this, &method)) {
     return false;
   }
   return call(AS_CLOSURE(method), arg_count);
 }
+/// Finds what invoking a method on the receiver below the arguments calls,
+/// without calling it. A field of the receiver holding the name takes the
+/// receiver's place on the stack, and is called instead of a method.
+///
+/// Returns:
+///   false if there is nothing to call, after reporting an error.
+static bool invoke_target(ObjString *name, size_t arg_count, bool is_this,
+                          Value *callee) {
+  Value reciever = peek(arg_count);
+  if (!IS_INSTANCE(reciever)) {
+    runtime_error("Only instances have methods.");
+    return false;
+  }
+  ObjInstance *instance = AS_INSTANCE(reciever);
+  // tries to acces the meathod from the instance's fields.
+  if (table_get(&instance->fields, name, callee)) {
+    vm.stack_top[-arg_count - 1] = *callee;
+    return true;
+  }
+  // if not fount in the instance, looks for the method in its class
+  return find_method(instance->klass, name, is_this, callee);
+}
 /// Invokes a method on an object or class with the specified number of
 /// arguments.
 ///
 /// Parameters:
 ///   name: The name of the method to invoke.
 ///   arg_count: The number of arguments to pass to the method.
+///   is_this: Whether the method is invoked on `this`, which allows calling
+///   private methods.
 ///
 /// Returns:
 ///   A boolean indicating whether the invocation was successful.
 ///   If false, a runtime error occurred.
-static bool invoke(ObjString *name, size_t arg_count) {
-  Value is_this = peek(arg_count);
-  Value reciever = peek(arg_count + 1);
-  if (!IS_INSTANCE(reciever)) {
-    runtime_error("Only instances have methods.");
+static bool invoke(ObjString *name, size_t arg_count, bool is_this) {
+  Value callee;
+  if (!invoke_target(name, arg_count, is_this, &callee)) {
     return false;
   }
-  ObjInstance *instance = AS_INSTANCE(reciever);
-  Value value;
-  // tries to acces the meathod from the instance's fields.
-  if (table_get(&instance->fields, name, &value)) {
-    vm.stack_top[-arg_count - 1] = value;
-    return call_value(value, arg_count);
-  }
-  // if not fount in the instance, looks for the method in its class
-  return invoke_from_class(instance->klass, name, arg_count, AS_BOOL(is_this));
+  return call_value(callee, arg_count);
 }
 /// Binds a method to an object instance by creating a bound method.
 ///
@@ -292,7 +689,7 @@ static bool invoke(ObjString *name, size_t arg_count) {
 ///   If false, a runtime error occurred.
 static bool bind_method(ObjClass *class, ObjString *name) {
   Value method;
-  if (!table_get(&class->methods, name, &method)) {
+  if (!method_table_get(&class->methods, name->symbol, &method)) {
     runtime_error("Undefined property '%s'.", name->chars);
     return false;
   }
@@ -329,17 +726,17 @@ static ObjUpvalue *capture_upvalue(Value *local) {
   }
   return created_upvalue;
 }
-/// Closes the upvalues that are no longer in scope.
+/// Refreshes the initializer cached on a class after its methods changed.
 ///
 /// Parameters:
-///   last: A pointer to the top of the stack, indicating the last value still
-///   in scope.
-static void close_upvalue(Value *last) {
-  while (vm.open_upvalues != NULL && vm.open_upvalues->location >= last) {
-    ObjUpvalue *upvalue = vm.open_upvalues;
-    upvalue->closed = *upvalue->location;
-    upvalue->location = &upvalue->closed;
-    vm.open_upvalues = upvalue->next;
+///   class: The class whose method table was modified.
+static void cache_initializer(ObjClass *class) {
+  Value initializer;
+  if (method_table_get(&class->methods, vm.init_string->symbol,
+                       &initializer)) {
+    class->initializer = AS_CLOSURE(initializer);
+  } else {
+    class->initializer = NULL;
   }
 }
 /// Defines a method for a class by adding it to the class's method table.
@@ -350,12 +747,141 @@ static void define_method(ObjString *name, bool private) {
   Value method = peek(0);
   ObjClass *class = AS_CLASS(peek(1));
   if (private) {
-    table_set(&class->private_methods, name, method);
+    method_table_set(&class->private_methods, name->symbol, method);
   } else {
-    table_set(&class->methods, name, method);
+    method_table_set(&class->methods, name->symbol, method);
+    if (name == vm.init_string) {
+      cache_initializer(class);
+    }
   }
   pop();
 }
+/// Tests the condition of a numeric for loop, whose comparison is held in
+/// the flags of OP_FORPREP and OP_FORLOOP.
+static inline bool for_condition(Value counter, Value limit, uint8_t flags) {
+  if (LIKELY(IS_INT(counter) && IS_INT(limit))) {
+    int32_t a = AS_INT(counter);
+    int32_t b = AS_INT(limit);
+    switch (flags & FOR_COMPARISON_MASK) {
+    case FOR_LESS:
+      return a < b;
+    case FOR_LESS_EQUAL:
+      return a <= b;
+    case FOR_GREATER:
+      return a > b;
+    default:
+      return a >= b;
+    }
+  }
+  double a = AS_NUMBER(counter);
+  double b = AS_NUMBER(limit);
+  switch (flags & FOR_COMPARISON_MASK) {
+  case FOR_LESS:
+    return a < b;
+  case FOR_LESS_EQUAL:
+    return a <= b;
+  case FOR_GREATER:
+    return a > b;
+  default:
+    return a >= b;
+  }
+}
+/// Multiplies two integers. A zero product with a negative factor is -0,
+/// which only a double can hold.
+static inline Value multiply_ints(int32_t a, int32_t b) {
+  int64_t product = (int64_t)a * b;
+  if (product == 0 && (a < 0 || b < 0)) {
+    return NUMBER_VAL(-0.0);
+  }
+  return int64_to_value(product);
+}
+/// Computes a modulo b with the sign of b, so that it agrees with floor
+/// division: a = (a \ b) * b + a % b.
+static inline double modulo_doubles(double a, double b) {
+  double remainder = fmod(a, b);
+  if (remainder != 0 && (remainder < 0) != (b < 0)) {
+    remainder += b;
+  }
+  // fmod keeps the sign of a in a zero remainder.
+  return remainder == 0 ? 0.0 : remainder;
+}
+static inline Value modulo_ints(int32_t a, int32_t b) {
+  if (b == 0) {
+    return NUMBER_VAL(modulo_doubles(a, b));
+  }
+  if (b == -1) {
+    // INT32_MIN % -1 overflows.
+    return INT_VAL(0);
+  }
+  int32_t remainder = a % b;
+  if (remainder != 0 && (remainder ^ b) < 0) {
+    remainder += b;
+  }
+  return INT_VAL(remainder);
+}
+/// Divides two integers, rounding towards negative infinity. Division by
+/// zero and a -0 quotient are left to doubles.
+static inline Value floor_divide_ints(int32_t a, int32_t b) {
+  if (b == 0 || (a == 0 && b < 0)) {
+    return NUMBER_VAL(floor((double)a / b));
+  }
+  int64_t quotient = (int64_t)a / b;
+  if (quotient * b != a && (a < 0) != (b < 0)) {
+    quotient--;
+  }
+  return int64_to_value(quotient);
+}
+/// Converts an operand of a bitwise operator to a 32-bit integer. Doubles
+/// holding an integer wrap around modulo 2^32.
+///
+/// Returns:
+///   false if value is not an integral number.
+static inline bool to_int32(Value value, int32_t *result) {
+  if (LIKELY(IS_INT(value))) {
+    *result = AS_INT(value);
+    return true;
+  }
+  if (!IS_NUMBER(value)) {
+    return false;
+  }
+  double number = AS_NUMBER(value);
+  if (!isfinite(number) || number != trunc(number)) {
+    return false;
+  }
+  double wrapped = fmod(number, 4294967296.0);
+  if (wrapped < 0) {
+    wrapped += 4294967296.0;
+  }
+  *result = (int32_t)(uint32_t)wrapped;
+  return true;
+}
+/// Finds where OP_SWITCH jumps to when value is switched on.
+static size_t switch_target(SwitchTable *table, Value value) {
+  if (IS_STRING(value)) {
+    Value target;
+    if (table_get(&table->strings, AS_STRING(value), &target)) {
+      return (size_t)AS_INT(target);
+    }
+    return table->default_target;
+  }
+  if (LIKELY(IS_INT(value))) {
+    uint64_t index = (uint64_t)((int64_t)AS_INT(value) - table->low);
+    if (index < table->jump_count) {
+      return table->jumps[index];
+    }
+  } else if (IS_NUMBER(value) && table->jump_count > 0) {
+    double index = AS_NUMBER(value) - table->low;
+    if (index >= 0 && index < table->jump_count && index == trunc(index)) {
+      return table->jumps[(size_t)index];
+    }
+  }
+  for (size_t i = 0; i < table->case_count; ++i) {
+    if (values_equal(table->cases[i].value, value)) {
+      return table->cases[i].target;
+    }
+  }
+  return table->default_target;
+}
 /// Checks if a given value is "falsey" according to Lox rules (in Salmon 0 is
 /// false).
 ///
@@ -368,8 +894,11 @@ static bool is_falsey(Value value) {
   return IS_NIL(value) || (IS_NUMBER(value) && AS_NUMBER(value) == 0.0) ||
          (IS_BOOL(value) && !AS_BOOL(value));
 }
+/// Copies an array. The copy is left on the stack while it is filled, and the
+/// caller pops it once it holds the copy somewhere else the GC can see.
 static ObjArray *copy_array(ObjArray *original) {
   ObjArray *copy = new_array();
+  push(OBJ_VAL(copy));
 
   // Copy the values from the original array to the new array
   for (size_t i = 0; i < original->length; ++i) {
@@ -389,12 +918,13 @@ static void append() {
   ObjString *index_str = int_to_string((int)array->length);
 
   // Use the new string to set the value in the table
-  table_set(&array->values, index_str, peek(0));
+  table_set(&array->values, index_str, peek(1));
 
   // Increment the length
   array->length++;
 
-  // Pop the value and array
+  // Pop the copy, value and array
+  pop();
   pop();
   pop();
 
@@ -426,370 +956,1221 @@ static void concatonate() {
 ///   The interpretation result, indicating success or the type of error
 ///   encountered.
 static InterpretResult run() {
-  CallFrame *frame = &vm.frames[vm.frame_count - 1];
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2]) << 8 | frame->ip[-1]))
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.value[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define BINARY_OP(value_type, op)                                              \
+  // The instruction pointer, the top of the stack and the frame's slots are
+  // cached in locals so the compiler can keep them in registers. They are
+  // written back with STORE_FRAME() before anything that looks at the VM
+  // state: calls, allocations (which may collect garbage) and errors.
+  CallFrame *frame;
+  Instruction *ip;
+  Value *stack_top;
+  Value *slots;
+  // The constant operand of the instruction being executed. A _LONG form
+  // reads its two-word operand and carries on with the body of its short
+  // form, past the one-word read.
+  Value *constant;
+  // What a tail call calls and with how many arguments. The tail forms of
+  // INVOKE look up the method, then carry on with the body of OP_TAIL_CALL.
+  Value tail_callee;
+  size_t tail_arg_count;
+#define STORE_FRAME() (frame->ip = ip, vm.stack_top = stack_top)
+#define LOAD_FRAME()                                                           \
+  (frame = &vm.frames[vm.frame_count - 1], ip = frame->ip,                     \
+   slots = frame->slots, stack_top = vm.stack_top)
+#define READ_BYTE() ((ip++)->operand)
+#define READ_SHORT() (ip += 2, ip[-2].operand)
+#define READ_CONSTANT() ((ip++)->constant)
+#define OPERAND_CONSTANT() (*constant)
+#define OPERAND_STRING() AS_STRING(OPERAND_CONSTANT())
+#define LONG_FORM(body)                                                        \
+  do {                                                                         \
+    constant = ip->constant;                                                   \
+    ip += 2;                                                                   \
+    goto body;                                                                 \
+  } while (false)
+// Read the operand at ip[index] and the constant it points at, without
+// moving the instruction pointer.
+#define OPERAND_AT(index) (ip[index].operand)
+#define READ_CONSTANT_AT(index) (*ip[index].constant)
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+// POP for when the value is not needed.
+#define DROP() ((void)--stack_top)
+#define PEEK(distance) (stack_top[-1 - (distance)])
+// Carries on after something was thrown: at the catch block that caught it,
+// or by stopping if nothing did, which leaves no frames.
+#define UNWIND()                                                               \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtime_error("Operands must be numbers.");                              \
+    if (vm.frame_count == 0) {                                                 \
       return INTERPRET_RUNTIME_ERROR;                                          \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(value_type(a op b));                                                  \
+    LOAD_FRAME();                                                              \
+    DISPATCH();                                                                \
+  } while (false)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    STORE_FRAME();                                                             \
+    runtime_error(__VA_ARGS__);                                                \
+    UNWIND();                                                                  \
+  } while (false)
+// The operations the arithmetic and comparison instructions are built from,
+// each in a version for two integers and one for any two numbers. Integer
+// results that overflow become doubles, and division always gives a double.
+#define ARITHMETIC_INT(a, op, b)                                               \
+  int64_to_value((int64_t)AS_INT(a) op AS_INT(b))
+#define ARITHMETIC_NUMBER(a, op, b) NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b))
+#define MULTIPLICATION_INT(a, op, b) multiply_ints(AS_INT(a), AS_INT(b))
+#define MULTIPLICATION_NUMBER(a, op, b) ARITHMETIC_NUMBER(a, op, b)
+#define DIVISION_INT(a, op, b) ARITHMETIC_NUMBER(a, op, b)
+#define DIVISION_NUMBER(a, op, b) ARITHMETIC_NUMBER(a, op, b)
+#define MODULO_INT(a, op, b) modulo_ints(AS_INT(a), AS_INT(b))
+#define MODULO_NUMBER(a, op, b)                                                \
+  NUMBER_VAL(modulo_doubles(AS_NUMBER(a), AS_NUMBER(b)))
+#define FLOOR_DIVISION_INT(a, op, b) floor_divide_ints(AS_INT(a), AS_INT(b))
+#define FLOOR_DIVISION_NUMBER(a, op, b)                                        \
+  NUMBER_VAL(floor(AS_NUMBER(a) / AS_NUMBER(b)))
+#define COMPARISON_INT(a, op, b) BOOL_VAL(AS_INT(a) op AS_INT(b))
+#define COMPARISON_NUMBER(a, op, b) BOOL_VAL(AS_NUMBER(a) op AS_NUMBER(b))
+// Stores `a op b` into result if a and b are numbers.
+//
+// Evaluates to false, leaving result alone, if either is not a number.
+#define NUMBER_OP(result, operation, a, op, b)                                 \
+  (LIKELY(IS_INT(a) && IS_INT(b))                                              \
+       ? ((result) = operation##_INT(a, op, b), true)                          \
+       : IS_NUMBER(a) && IS_NUMBER(b)                                          \
+             ? ((result) = operation##_NUMBER(a, op, b), true)                 \
+             : false)
+#define BINARY_OP(operation, op)                                               \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    if (!NUMBER_OP(PEEK(1), operation, a, op, b)) {                            \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    stack_top--;                                                               \
+  } while (false)
+// Bitwise operators work on 32-bit integers and always give one.
+#define BITWISE_OP(expression)                                                 \
+  do {                                                                         \
+    int32_t a;                                                                 \
+    int32_t b;                                                                 \
+    if (!to_int32(PEEK(1), &a) || !to_int32(PEEK(0), &b)) {                   \
+      RUNTIME_ERROR("Operands must be integers.");                             \
+    }                                                                          \
+    PEEK(1) = INT_VAL(expression);                                             \
+    stack_top--;                                                               \
+  } while (false)
+// Pops two numbers and jumps if comparing them with op is false.
+#define COMPARE_JUMP(op)                                                       \
+  do {                                                                         \
+    Value b = PEEK(0);                                                         \
+    Value a = PEEK(1);                                                         \
+    Value condition;                                                           \
+    if (!NUMBER_OP(condition, COMPARISON, a, op, b)) {                         \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    stack_top -= 2;                                                            \
+    ip = AS_BOOL(condition) ? ip + 2 : ip->target;                             \
+  } while (false)
+// The limit of a numeric for loop, held in a local slot or a constant.
+#define FOR_LIMIT(flags)                                                       \
+  ((flags) & FOR_LIMIT_CONSTANT ? READ_CONSTANT_AT(1) : slots[OPERAND_AT(1)])
+// Superinstructions for GET_LOCAL GET_LOCAL and GET_LOCAL CONSTANT followed
+// by a compare-and-jump. Like FUSED_BINARY_OP they carry on with the
+// GET_LOCAL if an operand is not a number.
+#define FUSED_COMPARE_JUMP(op, second)                                         \
+  do {                                                                         \
+    Value a = slots[OPERAND_AT(0)];                                            \
+    Value b = (second);                                                        \
+    Value condition;                                                           \
+    if (NUMBER_OP(condition, COMPARISON, a, op, b)) {                          \
+      ip = AS_BOOL(condition) ? ip + 6 : ip[4].target;                         \
+    } else {                                                                   \
+      PUSH(a);                                                                 \
+      ip += 1;                                                                 \
+    }                                                                          \
+  } while (false)
+// Superinstructions for a whole `a := b op c;` statement, storing the result
+// into the local at ip[5]. Like the other superinstructions they carry on
+// with the leading GET_LOCAL if an operand is not a number.
+#define ASSIGN_BINARY_OP(operation, op, operand)                               \
+  do {                                                                         \
+    Value a = slots[OPERAND_AT(0)];                                            \
+    Value b = (operand);                                                       \
+    if (NUMBER_OP(slots[OPERAND_AT(5)], operation, a, op, b)) {                \
+      ip += 7;                                                                 \
+    } else {                                                                   \
+      PUSH(a);                                                                 \
+      ip += 1;                                                                 \
+    }                                                                          \
+  } while (false)
+// Superinstructions for GET_LOCAL GET_LOCAL <op> and GET_LOCAL CONSTANT
+// <op>. If either operand is not a number they carry on with the GET_LOCAL,
+// and the instructions they cover handle the operation.
+#define FUSED_BINARY_OP(operation, op, second)                                 \
+  do {                                                                         \
+    Value a = slots[OPERAND_AT(0)];                                            \
+    Value b = (second);                                                        \
+    if (NUMBER_OP(*stack_top, operation, a, op, b)) {                          \
+      stack_top++;                                                             \
+      ip += 4;                                                                 \
+    } else {                                                                   \
+      PUSH(a);                                                                 \
+      ip += 1;                                                                 \
+    }                                                                          \
   } while (false)
 
-  for (;;) {
 #ifdef DEBUG_TRACE_EXECUTION
-    printf("          ");
-    for (Value *slot = vm.stack; slot < vm.stack_top; slot++) {
-      printf("[ ");
-      print_value(*slot);
-      printf(" ]");
-    }
-    printf("\n");
-    disassemble_instruction(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code));
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+    printf("          ");                                                      \
+    for (Value *slot = vm.stack; slot < stack_top; slot++) {                   \
+      printf("[ ");                                                            \
+      print_value(*slot);                                                      \
+      printf(" ]");                                                            \
+    }                                                                          \
+    printf("\n");                                                              \
+    disassemble_instruction(&frame->closure->function->chunk,                  \
+                            (int)(ip - frame->closure->function->code));       \
+  } while (false)
+#else
+#define TRACE_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
 #endif /* ifdef DEBUG_TRACE_EXECUTION */
-    uint8_t instruction;
-    switch (instruction = READ_BYTE()) {
-    case OP_PATH: {
-      if (IS_STRING(peek(0))) {
-        ObjString *path = AS_STRING(pop());
-        vm.path = path->chars;
-      }
-      break;
+#ifdef DEBUG_OPCODE_PAIRS
+// Counts the opcodes of the chunk, which quickening leaves alone.
+#define COUNT_INSTRUCTION()                                                    \
+  count_opcode_pair(                                                           \
+      frame->closure->function->chunk.code[ip - frame->closure->function->code])
+#else
+#define COUNT_INSTRUCTION()                                                    \
+  do {                                                                         \
+  } while (false)
+#endif /* ifdef DEBUG_OPCODE_PAIRS */
+
+#ifdef COMPUTED_GOTO
+  // Every handler jumps straight to the next one, which gives the branch
+  // predictor one indirect jump per opcode instead of a single shared one.
+  static void *dispatch_table[] = {
+      [OP_CONSTANT] = &&op_OP_CONSTANT,
+      [OP_NIL] = &&op_OP_NIL,
+      [OP_TRUE] = &&op_OP_TRUE,
+      [OP_FALSE] = &&op_OP_FALSE,
+      [OP_POP] = &&op_OP_POP,
+      [OP_GET_LOCAL] = &&op_OP_GET_LOCAL,
+      [OP_SET_LOCAL] = &&op_OP_SET_LOCAL,
+      [OP_GET_GLOBAL] = &&op_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&op_OP_DEFINE_GLOBAL,
+      [OP_SET_GLOBAL] = &&op_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&op_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&op_OP_SET_UPVALUE,
+      [OP_GET_FLAT_UPVALUE] = &&op_OP_GET_FLAT_UPVALUE,
+      [OP_GET_PROPERTY] = &&op_OP_GET_PROPERTY,
+      [OP_SET_PROPERTY] = &&op_OP_SET_PROPERTY,
+      [OP_GET_ELEMENT] = &&op_OP_GET_ELEMENT,
+      [OP_SET_ELEMENT] = &&op_OP_SET_ELEMENT,
+      [OP_GET_SUPER] = &&op_OP_GET_SUPER,
+      [OP_EQUAL] = &&op_OP_EQUAL,
+      [OP_GREATER] = &&op_OP_GREATER,
+      [OP_LESS] = &&op_OP_LESS,
+      [OP_NOT_EQUAL] = &&op_OP_NOT_EQUAL,
+      [OP_GREATER_EQUAL] = &&op_OP_GREATER_EQUAL,
+      [OP_LESS_EQUAL] = &&op_OP_LESS_EQUAL,
+      [OP_ADD] = &&op_OP_ADD,
+      [OP_SUBTRACT] = &&op_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&op_OP_MULTIPLY,
+      [OP_DIVIDE] = &&op_OP_DIVIDE,
+      [OP_MODULO] = &&op_OP_MODULO,
+      [OP_FLOOR_DIVIDE] = &&op_OP_FLOOR_DIVIDE,
+      [OP_BIT_XOR] = &&op_OP_BIT_XOR,
+      [OP_SHIFT_LEFT] = &&op_OP_SHIFT_LEFT,
+      [OP_SHIFT_RIGHT] = &&op_OP_SHIFT_RIGHT,
+      [OP_NOT] = &&op_OP_NOT,
+      [OP_NEGATE] = &&op_OP_NEGATE,
+      [OP_JUMP] = &&op_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&op_OP_JUMP_IF_FALSE,
+      [OP_JUMP_IF_NOT_EQUAL] = &&op_OP_JUMP_IF_NOT_EQUAL,
+      [OP_JUMP_IF_EQUAL] = &&op_OP_JUMP_IF_EQUAL,
+      [OP_JUMP_IF_NOT_GREATER] = &&op_OP_JUMP_IF_NOT_GREATER,
+      [OP_JUMP_IF_NOT_GREATER_EQUAL] = &&op_OP_JUMP_IF_NOT_GREATER_EQUAL,
+      [OP_JUMP_IF_NOT_LESS] = &&op_OP_JUMP_IF_NOT_LESS,
+      [OP_JUMP_IF_NOT_LESS_EQUAL] = &&op_OP_JUMP_IF_NOT_LESS_EQUAL,
+      [OP_LOOP] = &&op_OP_LOOP,
+      [OP_FORPREP] = &&op_OP_FORPREP,
+      [OP_FORLOOP] = &&op_OP_FORLOOP,
+      [OP_CALL] = &&op_OP_CALL,
+      [OP_TAIL_CALL] = &&op_OP_TAIL_CALL,
+      [OP_INHERIT] = &&op_OP_INHERIT,
+      [OP_INVOKE] = &&op_OP_INVOKE,
+      [OP_SUPER_INVOKE] = &&op_OP_SUPER_INVOKE,
+      [OP_TAIL_INVOKE] = &&op_OP_TAIL_INVOKE,
+      [OP_SUPER_TAIL_INVOKE] = &&op_OP_SUPER_TAIL_INVOKE,
+      [OP_CLOSURE] = &&op_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&op_OP_CLOSE_UPVALUE,
+      [OP_THROW] = &&op_OP_THROW,
+      [OP_SWITCH] = &&op_OP_SWITCH,
+      [OP_RETURN_VALUES] = &&op_OP_RETURN_VALUES,
+      [OP_UNPACK] = &&op_OP_UNPACK,
+      [OP_TUPLE] = &&op_OP_TUPLE,
+      [OP_RETURN] = &&op_OP_RETURN,
+      [OP_RETURN_INITIALIZER] = &&op_OP_RETURN_INITIALIZER,
+      [OP_CLASS] = &&op_OP_CLASS,
+      [OP_METHOD] = &&op_OP_METHOD,
+      [OP_PRIVATE_METHOD] = &&op_OP_PRIVATE_METHOD,
+      [OP_CONSTANT_LONG] = &&op_OP_CONSTANT_LONG,
+      [OP_GET_GLOBAL_LONG] = &&op_OP_GET_GLOBAL_LONG,
+      [OP_DEFINE_GLOBAL_LONG] = &&op_OP_DEFINE_GLOBAL_LONG,
+      [OP_SET_GLOBAL_LONG] = &&op_OP_SET_GLOBAL_LONG,
+      [OP_GET_PROPERTY_LONG] = &&op_OP_GET_PROPERTY_LONG,
+      [OP_SET_PROPERTY_LONG] = &&op_OP_SET_PROPERTY_LONG,
+      [OP_GET_SUPER_LONG] = &&op_OP_GET_SUPER_LONG,
+      [OP_INVOKE_LONG] = &&op_OP_INVOKE_LONG,
+      [OP_SUPER_INVOKE_LONG] = &&op_OP_SUPER_INVOKE_LONG,
+      [OP_TAIL_INVOKE_LONG] = &&op_OP_TAIL_INVOKE_LONG,
+      [OP_SUPER_TAIL_INVOKE_LONG] = &&op_OP_SUPER_TAIL_INVOKE_LONG,
+      [OP_CLOSURE_LONG] = &&op_OP_CLOSURE_LONG,
+      [OP_CLASS_LONG] = &&op_OP_CLASS_LONG,
+      [OP_METHOD_LONG] = &&op_OP_METHOD_LONG,
+      [OP_PRIVATE_METHOD_LONG] = &&op_OP_PRIVATE_METHOD_LONG,
+      [OP_GET_LOCAL_LONG] = &&op_OP_GET_LOCAL_LONG,
+      [OP_SET_LOCAL_LONG] = &&op_OP_SET_LOCAL_LONG,
+      [OP_GET_UPVALUE_LONG] = &&op_OP_GET_UPVALUE_LONG,
+      [OP_SET_UPVALUE_LONG] = &&op_OP_SET_UPVALUE_LONG,
+      [OP_GET_FLAT_UPVALUE_LONG] = &&op_OP_GET_FLAT_UPVALUE_LONG,
+      [OP_INCREMENT_LOCAL] = &&op_OP_INCREMENT_LOCAL,
+      [OP_ADD_LOCALS] = &&op_OP_ADD_LOCALS,
+      [OP_SUBTRACT_LOCALS] = &&op_OP_SUBTRACT_LOCALS,
+      [OP_MULTIPLY_LOCALS] = &&op_OP_MULTIPLY_LOCALS,
+      [OP_DIVIDE_LOCALS] = &&op_OP_DIVIDE_LOCALS,
+      [OP_GREATER_LOCALS] = &&op_OP_GREATER_LOCALS,
+      [OP_LESS_LOCALS] = &&op_OP_LESS_LOCALS,
+      [OP_ADD_LOCAL_CONSTANT] = &&op_OP_ADD_LOCAL_CONSTANT,
+      [OP_SUBTRACT_LOCAL_CONSTANT] = &&op_OP_SUBTRACT_LOCAL_CONSTANT,
+      [OP_MULTIPLY_LOCAL_CONSTANT] = &&op_OP_MULTIPLY_LOCAL_CONSTANT,
+      [OP_DIVIDE_LOCAL_CONSTANT] = &&op_OP_DIVIDE_LOCAL_CONSTANT,
+      [OP_GREATER_LOCAL_CONSTANT] = &&op_OP_GREATER_LOCAL_CONSTANT,
+      [OP_LESS_LOCAL_CONSTANT] = &&op_OP_LESS_LOCAL_CONSTANT,
+      [OP_JUMP_IF_NOT_GREATER_LOCALS] =
+          &&op_OP_JUMP_IF_NOT_GREATER_LOCALS,
+      [OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS] =
+          &&op_OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS,
+      [OP_JUMP_IF_NOT_LESS_LOCALS] =
+          &&op_OP_JUMP_IF_NOT_LESS_LOCALS,
+      [OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS] =
+          &&op_OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS,
+      [OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT] =
+          &&op_OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT,
+      [OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT] =
+          &&op_OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT,
+      [OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT] =
+          &&op_OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT,
+      [OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT] =
+          &&op_OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT,
+      [OP_COPY_LOCAL] = &&op_OP_COPY_LOCAL,
+      [OP_SET_LOCAL_CONSTANT] = &&op_OP_SET_LOCAL_CONSTANT,
+      [OP_ASSIGN_ADD_LOCALS] = &&op_OP_ASSIGN_ADD_LOCALS,
+      [OP_ASSIGN_SUBTRACT_LOCALS] = &&op_OP_ASSIGN_SUBTRACT_LOCALS,
+      [OP_ASSIGN_MULTIPLY_LOCALS] = &&op_OP_ASSIGN_MULTIPLY_LOCALS,
+      [OP_ASSIGN_DIVIDE_LOCALS] = &&op_OP_ASSIGN_DIVIDE_LOCALS,
+      [OP_ASSIGN_ADD_LOCAL_CONSTANT] = &&op_OP_ASSIGN_ADD_LOCAL_CONSTANT,
+      [OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT] =
+          &&op_OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT,
+      [OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT] =
+          &&op_OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT,
+      [OP_ASSIGN_DIVIDE_LOCAL_CONSTANT] = &&op_OP_ASSIGN_DIVIDE_LOCAL_CONSTANT,
+      [OP_ADD_NUM] = &&op_OP_ADD_NUM,
+      [OP_ADD_STR] = &&op_OP_ADD_STR,
+      [OP_GET_FIELD] = &&op_OP_GET_FIELD,
+      [OP_CALL_CLOSURE] = &&op_OP_CALL_CLOSURE,
+      [OP_GET_ELEMENT_ARRAY] = &&op_OP_GET_ELEMENT_ARRAY,
+  };
+  // Called without any frames, run() only hands over the handlers for
+  // decode_function().
+  if (vm.frame_count == 0) {
+    opcode_handlers = dispatch_table;
+    return INTERPRET_OK;
+  }
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(op) op_##op
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    COUNT_INSTRUCTION();                                                       \
+    goto *(ip++)->handler;                                                     \
+  } while (false)
+#define IS_OPCODE(instruction, op) ((instruction).handler == dispatch_table[op])
+#define SET_OPCODE(instruction, op) ((instruction).handler = dispatch_table[op])
+#else
+#define INTERPRET_LOOP                                                         \
+  loop:                                                                        \
+  TRACE_INSTRUCTION();                                                         \
+  COUNT_INSTRUCTION();                                                         \
+  switch (READ_BYTE())
+#define CASE(op) case op
+#define DISPATCH() goto loop
+#define IS_OPCODE(instruction, op) ((instruction).operand == (op))
+#define SET_OPCODE(instruction, op) ((instruction).operand = (op))
+#endif /* ifdef COMPUTED_GOTO */
+// Rewrites the specialized instruction being executed, whose opcode is at
+// ip[-1], back to its generic form and runs that instead.
+#define DEOPTIMIZE(generic)                                                    \
+  do {                                                                         \
+    SET_OPCODE(ip[-1], generic);                                               \
+    ip--;                                                                      \
+    DISPATCH();                                                                \
+  } while (false)
+
+  LOAD_FRAME();
+  INTERPRET_LOOP {
+    CASE(OP_NIL) : PUSH(NIL_VAL);
+    DISPATCH();
+    CASE(OP_TRUE) : PUSH(BOOL_VAL(true));
+    DISPATCH();
+    CASE(OP_FALSE) : PUSH(BOOL_VAL(false));
+    DISPATCH();
+    CASE(OP_POP) : DROP();
+    DISPATCH();
+    CASE(OP_GET_LOCAL) : {
+      size_t slot = READ_BYTE();
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_NIL:
-      push(NIL_VAL);
-      break;
-    case OP_TRUE:
-      push(BOOL_VAL(true));
-      break;
-    case OP_FALSE:
-      push(BOOL_VAL(false));
-      break;
-    case OP_POP:
-      pop();
-      break;
-    case OP_GET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      push(frame->slots[slot]);
-      break;
+    CASE(OP_GET_LOCAL_LONG) : {
+      size_t slot = READ_SHORT();
+      PUSH(slots[slot]);
+      DISPATCH();
     }
-    case OP_SET_LOCAL: {
-      uint8_t slot = READ_BYTE();
-      frame->slots[slot] = peek(0);
-      break;
+    CASE(OP_SET_LOCAL) : {
+      size_t slot = READ_BYTE();
+      slots[slot] = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_LONG) : {
+      size_t slot = READ_SHORT();
+      slots[slot] = PEEK(0);
+      DISPATCH();
     }
-    case OP_GET_GLOBAL: {
-      ObjString *name = READ_STRING();
+    CASE(OP_GET_GLOBAL_LONG) : LONG_FORM(get_global_body);
+    CASE(OP_GET_GLOBAL) : constant = READ_CONSTANT();
+    get_global_body : {
+      ObjString *name = OPERAND_STRING();
       Value value;
       if (!table_get(&vm.globals, name, &value)) {
-        runtime_error("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
       }
-      push(value);
-      break;
+      PUSH(value);
+      DISPATCH();
     }
-    case OP_DEFINE_GLOBAL: {
-      ObjString *name = READ_STRING();
-      table_set(&vm.globals, name, peek(0));
-      pop();
-      break;
+    CASE(OP_DEFINE_GLOBAL_LONG) : LONG_FORM(define_global_body);
+    CASE(OP_DEFINE_GLOBAL) : constant = READ_CONSTANT();
+    define_global_body : {
+      ObjString *name = OPERAND_STRING();
+      STORE_FRAME();
+      table_set(&vm.globals, name, PEEK(0));
+      DROP();
+      DISPATCH();
     }
-    case OP_SET_GLOBAL: {
-      ObjString *name = READ_STRING();
-      if (table_set(&vm.globals, name, peek(0))) {
+    CASE(OP_SET_GLOBAL_LONG) : LONG_FORM(set_global_body);
+    CASE(OP_SET_GLOBAL) : constant = READ_CONSTANT();
+    set_global_body : {
+      ObjString *name = OPERAND_STRING();
+      STORE_FRAME();
+      if (table_set(&vm.globals, name, PEEK(0))) {
         table_delete(&vm.globals, name);
-        runtime_error("Undefined variable '%s'.", name->chars);
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Undefined variable '%s'.", name->chars);
       }
-      break;
+      DISPATCH();
     }
-    case OP_GET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      push(*frame->closure->upvalues[slot]->location);
-      break;
+    CASE(OP_GET_UPVALUE) : {
+      size_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
     }
-    case OP_SET_UPVALUE: {
-      uint8_t slot = READ_BYTE();
-      *frame->closure->upvalues[slot]->location = peek(0);
-      break;
+    CASE(OP_GET_UPVALUE_LONG) : {
+      size_t slot = READ_SHORT();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE) : {
+      size_t slot = READ_BYTE();
+      *frame->closure->upvalues[slot]->location = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE_LONG) : {
+      size_t slot = READ_SHORT();
+      *frame->closure->upvalues[slot]->location = PEEK(0);
+      DISPATCH();
+    }
+    CASE(OP_GET_FLAT_UPVALUE) : {
+      size_t slot = READ_BYTE();
+      PUSH(frame->closure->flat_upvalues[slot]);
+      DISPATCH();
     }
-    case OP_GET_PROPERTY: {
-      if (!IS_INSTANCE(peek(0))) {
-        runtime_error("Only instances have properties.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_GET_FLAT_UPVALUE_LONG) : {
+      size_t slot = READ_SHORT();
+      PUSH(frame->closure->flat_upvalues[slot]);
+      DISPATCH();
+    }
+    CASE(OP_GET_PROPERTY_LONG) : LONG_FORM(get_property_body);
+    CASE(OP_GET_PROPERTY) : constant = READ_CONSTANT();
+    get_property_body : {
+      if (!IS_INSTANCE(PEEK(0))) {
+        RUNTIME_ERROR("Only instances have properties.");
       }
-      ObjInstance *instance = AS_INSTANCE(peek(0));
-      ObjString *name = READ_STRING();
+      ObjInstance *instance = AS_INSTANCE(PEEK(0));
+      ObjString *name = OPERAND_STRING();
+      Instruction *cache = ip++;
       Value value;
-      if (table_get(&instance->fields, name, &value)) {
-        pop();
-        push(value);
-        break;
+      size_t slot;
+      if (table_get_slot(&instance->fields, name, &value, &slot)) {
+        // OP_GET_FIELD has the layout of the short form, whose opcode is two
+        // words before the cache. In the _LONG form that word is the
+        // constant, and it is left as it is.
+        if (slot < instance->fields.capacity &&
+            IS_OPCODE(cache[-2], OP_GET_PROPERTY)) {
+          SET_OPCODE(cache[-2], OP_GET_FIELD);
+          cache->operand = slot;
+        }
+        PEEK(0) = value;
+        DISPATCH();
       }
+      STORE_FRAME();
       if (!bind_method(instance->klass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+        UNWIND();
       }
-      break;
+      stack_top = vm.stack_top;
+      DISPATCH();
     }
-    case OP_SET_PROPERTY: {
-      if (!IS_INSTANCE(peek(1))) {
-        runtime_error("Only instances have fields.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SET_PROPERTY_LONG) : LONG_FORM(set_property_body);
+    CASE(OP_SET_PROPERTY) : constant = READ_CONSTANT();
+    set_property_body : {
+      if (!IS_INSTANCE(PEEK(1))) {
+        RUNTIME_ERROR("Only instances have fields.");
       }
-      ObjInstance *instance = AS_INSTANCE(peek(1));
-      table_set(&instance->fields, READ_STRING(), peek(0));
-      Value value = pop();
-      pop();
-      push(value);
-      break;
+      ObjInstance *instance = AS_INSTANCE(PEEK(1));
+      ObjString *name = OPERAND_STRING();
+      STORE_FRAME();
+      table_set(&instance->fields, name, PEEK(0));
+      Value value = POP();
+      PEEK(0) = value;
+      DISPATCH();
     }
-    case OP_GET_SUPER: {
-      ObjString *name = READ_STRING();
-      ObjClass *superclass = AS_CLASS(pop());
+    CASE(OP_GET_SUPER_LONG) : LONG_FORM(get_super_body);
+    CASE(OP_GET_SUPER) : constant = READ_CONSTANT();
+    get_super_body : {
+      ObjString *name = OPERAND_STRING();
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
       if (!bind_method(superclass, name)) {
-        return INTERPRET_RUNTIME_ERROR;
+        UNWIND();
       }
-      break;
+      stack_top = vm.stack_top;
+      DISPATCH();
     }
-    case OP_GET_ELEMENT: {
-      if (!IS_ARRAY(peek(1)) && !IS_STRING(peek(1))) {
-        runtime_error("Can not access element of a non array/string.");
+    CASE(OP_GET_ELEMENT) : {
+      if (!IS_ARRAY(PEEK(1)) && !IS_STRING(PEEK(1)) && !IS_TUPLE(PEEK(1))) {
+        RUNTIME_ERROR("Can not access element of a non array/string/tuple.");
+      }
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Index must be a number.");
       }
-      if (IS_ARRAY(peek(1))) {
-        ObjArray *array = AS_ARRAY(peek(1));
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Index must be a number.");
+      int i = IS_INT(PEEK(0)) ? AS_INT(PEEK(0)) : (int)AS_NUMBER(PEEK(0));
+      STORE_FRAME();
+      if (IS_ARRAY(PEEK(1))) {
+        SET_OPCODE(ip[-1], OP_GET_ELEMENT_ARRAY);
+        ObjArray *array = AS_ARRAY(PEEK(1));
+        if (i < 0 || (size_t)i >= array->length) {
+          RUNTIME_ERROR("Index of %d out of bounds for array of length %zu.",
+                        i, array->length);
         }
-        Value index = peek(0);
         Value value;
-        int i = (int)(AS_NUMBER(index));
-        if (i < array->length && i >= 0) {
-          pop();
-          pop();
-          table_get(&array->values, int_to_string(i), &value);
-          push(value);
-          break;
+        table_get(&array->values, int_to_string(i), &value);
+        DROP();
+        PEEK(0) = value;
+      } else if (IS_TUPLE(PEEK(1))) {
+        ObjTuple *tuple = AS_TUPLE(PEEK(1));
+        if (i < 0 || (size_t)i >= tuple->length) {
+          RUNTIME_ERROR("Index of %d out of bounds for tuple of length %zu.",
+                        i, tuple->length);
         }
-        runtime_error("Index of %d out of bounds for array of length %zu.", i,
-                      array->values.count);
-        break;
+        DROP();
+        PEEK(0) = tuple->values[i];
       } else {
-        ObjString *string = AS_STRING(peek(1));
-        if (!IS_NUMBER(peek(0))) {
-          runtime_error("Index must be a number.");
+        ObjString *string = AS_STRING(PEEK(1));
+        if (i < 0 || (size_t)i >= string->length) {
+          RUNTIME_ERROR("Index of %d out of bounds for array of length %zu.",
+                        i, string->length);
         }
-        Value index = peek(0);
-        int i = (int)(AS_NUMBER(index));
-        if (i < string->length && i >= 0) {
-          pop();
-          pop();
-          char *c = ALLOCATE(char, 2);
-          memcpy(c, string->chars + i, 1);
-          c[1] = '\0';
-          ObjString *result = take_string(c, 2);
-          push(OBJ_VAL(result));
-          break;
-        }
-        runtime_error("Index of %d out of bounds for array of length %zu.", i,
-                      string->length);
-        break;
+        char *c = ALLOCATE(char, 2);
+        memcpy(c, string->chars + i, 1);
+        c[1] = '\0';
+        ObjString *result = take_string(c, 1);
+        DROP();
+        PEEK(0) = OBJ_VAL(result);
       }
-      break;
+      DISPATCH();
     }
-    case OP_SET_ELEMENT: {
-      if (!IS_ARRAY(peek(2))) {
-        runtime_error("Cannot set element of a non-array.");
+    CASE(OP_SET_ELEMENT) : {
+      if (IS_TUPLE(PEEK(2))) {
+        RUNTIME_ERROR("Tuples are immutable.");
       }
-
-      ObjArray *originalArray = copy_array(AS_ARRAY(peek(2)));
-
-      if (!IS_NUMBER(peek(1))) {
-        runtime_error("Index must be a number.");
+      if (!IS_ARRAY(PEEK(2))) {
+        RUNTIME_ERROR("Cannot set element of a non-array.");
       }
-
-      Value index = peek(1);
-      int i = (int)(AS_NUMBER(index));
-
-      if (i < originalArray->values.count && i >= 0) {
-        Value value = pop(); // Pop the value to be set.
-        table_set(&originalArray->values, int_to_string(i), value);
-        pop();       // Pop the index.
-        pop();       // Pop the array.
-        push(value); // Push the value back onto the stack.
-        push(OBJ_VAL(originalArray));
-        break;
+      if (!IS_NUMBER(PEEK(1))) {
+        RUNTIME_ERROR("Index must be a number.");
+      }
+      int i = IS_INT(PEEK(1)) ? AS_INT(PEEK(1)) : (int)AS_NUMBER(PEEK(1));
+      if (i < 0 || (size_t)i >= AS_ARRAY(PEEK(2))->length) {
+        RUNTIME_ERROR("Index of %d out of bounds for array of length %zu.", i,
+                      AS_ARRAY(PEEK(2))->length);
       }
+      STORE_FRAME();
+      ObjArray *originalArray = copy_array(AS_ARRAY(PEEK(2)));
+      table_set(&originalArray->values, int_to_string(i), PEEK(0));
+      pop(); // Pop the copy.
 
-      runtime_error("Index of %d out of bounds for array of length %zu.", i,
-                    originalArray->values.count);
-      break;
+      Value value = POP(); // Pop the value to be set.
+      DROP();      // Pop the index.
+      DROP();      // Pop the array.
+      PUSH(value); // Push the value back onto the stack.
+      PUSH(OBJ_VAL(originalArray));
+      DISPATCH();
     }
-    case OP_EQUAL: {
-      Value b = pop();
-      Value a = pop();
-      push(BOOL_VAL(values_equal(a, b)));
-      break;
+    CASE(OP_EQUAL) : {
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(values_equal(a, b)));
+      DISPATCH();
     }
-    case OP_GREATER:
-      BINARY_OP(BOOL_VAL, >);
-      break;
-    case OP_LESS:
-      BINARY_OP(BOOL_VAL, <);
-      break;
-    case OP_ADD: {
-      if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
+    CASE(OP_GREATER) : BINARY_OP(COMPARISON, >);
+    DISPATCH();
+    CASE(OP_LESS) : BINARY_OP(COMPARISON, <);
+    DISPATCH();
+    CASE(OP_NOT_EQUAL) : {
+      Value b = POP();
+      Value a = POP();
+      PUSH(BOOL_VAL(!values_equal(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER_EQUAL) : BINARY_OP(COMPARISON, >=);
+    DISPATCH();
+    CASE(OP_LESS_EQUAL) : BINARY_OP(COMPARISON, <=);
+    DISPATCH();
+    CASE(OP_ADD) : {
+      Value b = PEEK(0);
+      Value a = PEEK(1);
+      if (NUMBER_OP(PEEK(1), ARITHMETIC, a, +, b)) {
+        SET_OPCODE(ip[-1], OP_ADD_NUM);
+        stack_top--;
+      } else if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))) {
+        SET_OPCODE(ip[-1], OP_ADD_STR);
+        STORE_FRAME();
         concatonate();
-      } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-        double b = AS_NUMBER(pop());
-        double a = AS_NUMBER(pop());
-        push(NUMBER_VAL(a + b));
-      } else if (IS_ARRAY(peek(1))) {
+        stack_top = vm.stack_top;
+      } else if (IS_ARRAY(PEEK(1))) {
+        STORE_FRAME();
         append();
+        stack_top = vm.stack_top;
       } else {
-        runtime_error("Operands must be either two strings or two numbers.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Operands must be either two strings or two numbers.");
       }
-      break;
+      DISPATCH();
     }
-    case OP_SUBTRACT:
-      BINARY_OP(NUMBER_VAL, -);
-      break;
-    case OP_MULTIPLY:
-      BINARY_OP(NUMBER_VAL, *);
-      break;
-    case OP_DIVIDE:
-      BINARY_OP(NUMBER_VAL, /);
-      break;
-    case OP_NOT:
-      push(BOOL_VAL(is_falsey(pop())));
-      break;
-    case OP_NEGATE:
-      if (!IS_NUMBER(peek(0))) {
-        runtime_error("Operand must be a number.");
-        return INTERPRET_RUNTIME_ERROR;
+    CASE(OP_SUBTRACT) : BINARY_OP(ARITHMETIC, -);
+    DISPATCH();
+    CASE(OP_MULTIPLY) : BINARY_OP(MULTIPLICATION, *);
+    DISPATCH();
+    CASE(OP_DIVIDE) : BINARY_OP(DIVISION, /);
+    DISPATCH();
+    CASE(OP_MODULO) : BINARY_OP(MODULO, %);
+    DISPATCH();
+    CASE(OP_FLOOR_DIVIDE) : BINARY_OP(FLOOR_DIVISION, /);
+    DISPATCH();
+    CASE(OP_BIT_XOR) : BITWISE_OP(a ^ b);
+    DISPATCH();
+    CASE(OP_SHIFT_LEFT) : BITWISE_OP((int32_t)((uint32_t)a << (b & 31)));
+    DISPATCH();
+    CASE(OP_SHIFT_RIGHT) : BITWISE_OP(a >> (b & 31));
+    DISPATCH();
+    CASE(OP_NOT) : PEEK(0) = BOOL_VAL(is_falsey(PEEK(0)));
+    DISPATCH();
+    CASE(OP_NEGATE) : {
+      if (!IS_NUMBER(PEEK(0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      push(NUMBER_VAL(-AS_NUMBER(pop())));
-      break;
-    case OP_JUMP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip += offset;
-      break;
+      Value value = PEEK(0);
+      PEEK(0) = IS_INT(value) && AS_INT(value) != 0
+                    ? int64_to_value(-(int64_t)AS_INT(value))
+                    : NUMBER_VAL(-AS_NUMBER(value));
+      DISPATCH();
+    }
+    CASE(OP_JUMP) : ip = ip->target;
+    DISPATCH();
+    CASE(OP_JUMP_IF_FALSE) : {
+      ip = is_falsey(PEEK(0)) ? ip->target : ip + 2;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_EQUAL) : {
+      Value b = POP();
+      Value a = POP();
+      ip = values_equal(a, b) ? ip + 2 : ip->target;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_EQUAL) : {
+      Value b = POP();
+      Value a = POP();
+      ip = values_equal(a, b) ? ip->target : ip + 2;
+      DISPATCH();
     }
-    case OP_JUMP_IF_FALSE: {
-      uint16_t offset = READ_SHORT();
-      if (is_falsey(peek(0))) {
-        frame->ip += offset;
+    CASE(OP_JUMP_IF_NOT_GREATER) : COMPARE_JUMP(>);
+    DISPATCH();
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL) : COMPARE_JUMP(>=);
+    DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS) : COMPARE_JUMP(<);
+    DISPATCH();
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL) : COMPARE_JUMP(<=);
+    DISPATCH();
+    CASE(OP_LOOP) : ip = ip->target;
+    DISPATCH();
+    CASE(OP_FORPREP) : {
+      uint8_t flags = OPERAND_AT(2);
+      Value counter = slots[OPERAND_AT(0)];
+      Value limit = FOR_LIMIT(flags);
+      if (!IS_NUMBER(counter) || !IS_NUMBER(limit)) {
+        RUNTIME_ERROR("Operands must be numbers.");
       }
-      break;
+      ip = for_condition(counter, limit, flags) ? ip + 5 : ip[3].target;
+      DISPATCH();
     }
-    case OP_LOOP: {
-      uint16_t offset = READ_SHORT();
-      frame->ip -= offset;
-      break;
+    CASE(OP_FORLOOP) : {
+      uint8_t flags = OPERAND_AT(3);
+      Value counter = slots[OPERAND_AT(0)];
+      Value step = READ_CONSTANT_AT(2);
+      Value next;
+      if (!NUMBER_OP(next, ARITHMETIC, counter, +, step)) {
+        RUNTIME_ERROR("Operands must be either two strings or two numbers.");
+      }
+      slots[OPERAND_AT(0)] = next;
+      Value limit = FOR_LIMIT(flags);
+      if (!IS_NUMBER(limit)) {
+        RUNTIME_ERROR("Operands must be numbers.");
+      }
+      ip = for_condition(next, limit, flags) ? ip[4].target : ip + 6;
+      DISPATCH();
     }
-    case OP_CALL: {
+    CASE(OP_CALL) : {
       size_t arg_count = READ_BYTE();
-      if (!call_value(peek(arg_count), arg_count)) {
-        return INTERPRET_RUNTIME_ERROR;
+      if (IS_CLOSURE(PEEK(arg_count))) {
+        SET_OPCODE(ip[-2], OP_CALL_CLOSURE);
       }
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
+      STORE_FRAME();
+      if (!call_value(PEEK(arg_count), arg_count)) {
+        UNWIND();
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL) : tail_arg_count = READ_BYTE();
+    tail_callee = PEEK(tail_arg_count);
+    tail_call_body : {
+      size_t arg_count = tail_arg_count;
+      Value callee = tail_callee;
+      if (!IS_CLOSURE(callee)) {
+        // Anything but a closure is called as usual, and the RETURN that
+        // follows hands back its result.
+        STORE_FRAME();
+        if (!call_value(callee, arg_count)) {
+          UNWIND();
+        }
+        LOAD_FRAME();
+        DISPATCH();
+      }
+      ObjClosure *closure = AS_CLOSURE(callee);
+      if (arg_count != closure->function->arity) {
+        RUNTIME_ERROR("Expected %d arguments but got %d.",
+                      closure->function->arity, arg_count);
+      }
+      // Reuse the frame and its stack window for the callee.
+      close_upvalue(slots);
+      memmove(slots, stack_top - arg_count - 1,
+              sizeof(Value) * (arg_count + 1));
+      stack_top = slots + arg_count + 1;
+      STORE_FRAME();
+      if (!reserve_stack(closure->function->max_stack - arg_count - 1)) {
+        UNWIND();
+      }
+      Instruction *code = function_code(closure->function);
+      frame->closure = closure;
+      LOAD_FRAME();
+      ip = code;
+      DISPATCH();
     }
-    case OP_INVOKE: {
-      ObjString *method = READ_STRING();
+    CASE(OP_TAIL_INVOKE_LONG) : LONG_FORM(tail_invoke_body);
+    CASE(OP_TAIL_INVOKE) : constant = READ_CONSTANT();
+    tail_invoke_body : {
+      ObjString *method = OPERAND_STRING();
+      tail_arg_count = READ_BYTE();
+      bool is_this = AS_BOOL(POP());
+      STORE_FRAME();
+      if (!invoke_target(method, tail_arg_count, is_this, &tail_callee)) {
+        UNWIND();
+      }
+      goto tail_call_body;
+    }
+    CASE(OP_SUPER_TAIL_INVOKE_LONG) : LONG_FORM(super_tail_invoke_body);
+    CASE(OP_SUPER_TAIL_INVOKE) : constant = READ_CONSTANT();
+    super_tail_invoke_body : {
+      ObjString *method = OPERAND_STRING();
+      tail_arg_count = READ_BYTE();
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
+      if (!find_method(superclass, method, false, &tail_callee)) {
+        UNWIND();
+      }
+      goto tail_call_body;
+    }
+    CASE(OP_INVOKE_LONG) : LONG_FORM(invoke_body);
+    CASE(OP_INVOKE) : constant = READ_CONSTANT();
+    invoke_body : {
+      ObjString *method = OPERAND_STRING();
       size_t arg_count = READ_BYTE();
-      if (!invoke(method, arg_count)) {
-        return INTERPRET_RUNTIME_ERROR;
+      // The compiler pushes whether the reciever is `this` after the
+      // arguments.
+      bool is_this = AS_BOOL(POP());
+      STORE_FRAME();
+      if (!invoke(method, arg_count, is_this)) {
+        UNWIND();
       }
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_SUPER_INVOKE: {
-      ObjString *method = READ_STRING();
+    CASE(OP_SUPER_INVOKE_LONG) : LONG_FORM(super_invoke_body);
+    CASE(OP_SUPER_INVOKE) : constant = READ_CONSTANT();
+    super_invoke_body : {
+      ObjString *method = OPERAND_STRING();
       size_t arg_count = READ_BYTE();
-      ObjClass *superclass = AS_CLASS(pop());
+      ObjClass *superclass = AS_CLASS(POP());
+      STORE_FRAME();
       if (!invoke_from_class(superclass, method, arg_count, false)) {
-        return INTERPRET_RUNTIME_ERROR;
+        UNWIND();
       }
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
+      LOAD_FRAME();
+      DISPATCH();
     }
-    case OP_CLOSURE: {
-      ObjFunction *function = AS_FUNCTION(READ_CONSTANT());
+    CASE(OP_CLOSURE_LONG) : LONG_FORM(closure_body);
+    CASE(OP_CLOSURE) : constant = READ_CONSTANT();
+    closure_body : {
+      ObjFunction *function = AS_FUNCTION(OPERAND_CONSTANT());
+      STORE_FRAME();
       ObjClosure *closure = new_closure(function);
       push(OBJ_VAL(closure));
       for (size_t i = 0; i < closure->upvalue_count; ++i) {
-        uint8_t is_local = READ_BYTE();
-        uint8_t index = READ_BYTE();
-        if (is_local) {
-          closure->upvalues[i] = capture_upvalue(frame->slots + index);
+        uint8_t flags = READ_BYTE();
+        uint16_t index = flags & CAPTURE_LONG ? READ_SHORT() : READ_BYTE();
+        if (flags & CAPTURE_LOCAL) {
+          closure->upvalues[i] = capture_upvalue(slots + index);
         } else {
           closure->upvalues[i] = frame->closure->upvalues[index];
         }
       }
-      break;
+      for (size_t i = 0; i < closure->flat_upvalue_count; ++i) {
+        uint8_t flags = READ_BYTE();
+        uint16_t index = flags & CAPTURE_LONG ? READ_SHORT() : READ_BYTE();
+        closure->flat_upvalues[i] = flags & CAPTURE_LOCAL
+                                        ? slots[index]
+                                        : frame->closure->flat_upvalues[index];
+      }
+      stack_top = vm.stack_top;
+      DISPATCH();
     }
-    case OP_CLOSE_UPVALUE:
-      close_upvalue(vm.stack_top - 1);
-      pop();
-      break;
-    case OP_RETURN: {
-      Value result = pop();
-      close_upvalue(frame->slots);
+    CASE(OP_CLOSE_UPVALUE) : close_upvalue(stack_top - 1);
+    DROP();
+    DISPATCH();
+    CASE(OP_THROW) : {
+      Value exception = POP();
+      STORE_FRAME();
+      throw_value(exception);
+      UNWIND();
+    }
+    CASE(OP_SWITCH) : {
+      ObjFunction *function = frame->closure->function;
+      SwitchTable *table = &function->chunk.switches[READ_SHORT()];
+      ip = function->code + switch_target(table, POP());
+      DISPATCH();
+    }
+    CASE(OP_RETURN_INITIALIZER) : {
+      // Only the class's own init speaks for its instances, not a
+      // superclass init reached through super.init(). Averaging with the
+      // earlier hint keeps one odd instance from sizing all the later ones.
+      ObjInstance *instance = AS_INSTANCE(PEEK(0));
+      ObjClass *klass = instance->klass;
+      if (frame->closure == klass->initializer) {
+        klass->field_hint =
+            (klass->field_hint + instance->fields.count + 1) / 2;
+      }
+      goto return_body;
+    }
+    CASE(OP_RETURN) : return_body : {
+      Value result = POP();
+      close_upvalue(slots);
       vm.frame_count--;
       if (vm.frame_count == 0) {
-        pop();
+        vm.stack_top = slots;
         return INTERPRET_OK;
       }
-      vm.stack_top = frame->slots;
-      push(result);
-      frame = &vm.frames[vm.frame_count - 1];
-      break;
+      // The caller's frame sits right below, and returning never moves the
+      // frames.
+      stack_top = slots;
+      frame--;
+      ip = frame->ip;
+      slots = frame->slots;
+      PUSH(result);
+      DISPATCH();
     }
-    case OP_CLASS:
-      push(OBJ_VAL(new_class(READ_STRING())));
-      break;
-    case OP_INHERIT: {
-      Value superclass = peek(1);
+    CASE(OP_RETURN_VALUES) : {
+      size_t count = READ_BYTE();
+      Value *values = stack_top - count;
+      // `return f();` hands on every value f returns, whether or not it was
+      // made a tail call, so the values go to the first caller that does
+      // something other than return them.
+      Value *result;
+      do {
+        close_upvalue(slots);
+        vm.frame_count--;
+        if (vm.frame_count == 0) {
+          vm.stack_top = slots;
+          return INTERPRET_OK;
+        }
+        result = slots;
+        frame--;
+        ip = frame->ip;
+        slots = frame->slots;
+      } while (IS_OPCODE(*ip, OP_RETURN));
+      // Only a call followed by OP_UNPACK takes all the values, which are
+      // unpacked here. Anywhere else the call stands for its first value.
+      size_t wanted = 1;
+      if (IS_OPCODE(*ip, OP_UNPACK)) {
+        wanted = OPERAND_AT(1);
+        ip += 2;
+      }
+      size_t kept = count < wanted ? count : wanted;
+      memmove(result, values, sizeof(Value) * kept);
+      stack_top = result + kept;
+      while (kept++ < wanted) {
+        PUSH(NIL_VAL);
+      }
+      DISPATCH();
+    }
+    CASE(OP_UNPACK) : {
+      // The expression before it left a single value.
+      size_t count = READ_BYTE();
+      while (count-- > 1) {
+        PUSH(NIL_VAL);
+      }
+      DISPATCH();
+    }
+    CASE(OP_TUPLE) : {
+      size_t length = READ_BYTE();
+      STORE_FRAME();
+      ObjTuple *tuple = new_tuple(stack_top - length, length);
+      stack_top -= length;
+      PUSH(OBJ_VAL(tuple));
+      DISPATCH();
+    }
+    CASE(OP_CLASS_LONG) : LONG_FORM(class_body);
+    CASE(OP_CLASS) : constant = READ_CONSTANT();
+    class_body : {
+      ObjString *name = OPERAND_STRING();
+      STORE_FRAME();
+      PUSH(OBJ_VAL(new_class(name)));
+      DISPATCH();
+    }
+    CASE(OP_INHERIT) : {
+      Value superclass = PEEK(1);
       if (!IS_CLASS(superclass)) {
-        runtime_error("Superclass must be a class.");
-        return INTERPRET_RUNTIME_ERROR;
+        RUNTIME_ERROR("Superclass must be a class.");
       }
-      ObjClass *subclass = AS_CLASS(peek(0));
-      table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
-      table_add_all(&AS_CLASS(superclass)->private_methods, &subclass->private_methods);
-      pop();
-      break;
+      ObjClass *subclass = AS_CLASS(PEEK(0));
+      STORE_FRAME();
+      method_table_add_all(&AS_CLASS(superclass)->methods, &subclass->methods);
+      method_table_add_all(&AS_CLASS(superclass)->private_methods,
+                           &subclass->private_methods);
+      cache_initializer(subclass);
+      DROP();
+      DISPATCH();
     }
-    case OP_METHOD:
-      define_method(READ_STRING(), false);
-      break;
-    case OP_PRIVATE_METHOD:
-      define_method(READ_STRING(), true);
-      break;
-    case OP_CONSTANT: {
-      Value constant = READ_CONSTANT();
-      push(constant);
-      break;
+    CASE(OP_METHOD_LONG) : LONG_FORM(method_body);
+    CASE(OP_METHOD) : constant = READ_CONSTANT();
+    method_body : {
+      ObjString *name = OPERAND_STRING();
+      STORE_FRAME();
+      define_method(name, false);
+      stack_top = vm.stack_top;
+      DISPATCH();
+    }
+    CASE(OP_PRIVATE_METHOD_LONG) : LONG_FORM(private_method_body);
+    CASE(OP_PRIVATE_METHOD) : constant = READ_CONSTANT();
+    private_method_body : {
+      ObjString *name = OPERAND_STRING();
+      STORE_FRAME();
+      define_method(name, true);
+      stack_top = vm.stack_top;
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT_LONG) : LONG_FORM(constant_body);
+    CASE(OP_CONSTANT) : constant = READ_CONSTANT();
+    constant_body : PUSH(OPERAND_CONSTANT());
+    DISPATCH();
+    CASE(OP_INCREMENT_LOCAL) : {
+      // GET_LOCAL slot CONSTANT index ADD SET_LOCAL slot POP
+      Value *local = &slots[OPERAND_AT(0)];
+      Value step = READ_CONSTANT_AT(2);
+      if (NUMBER_OP(*local, ARITHMETIC, *local, +, step)) {
+        ip += 7;
+      } else {
+        PUSH(*local);
+        ip += 1;
+      }
+      DISPATCH();
+    }
+    CASE(OP_ADD_LOCALS) : {
+      FUSED_BINARY_OP(ARITHMETIC, +, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_LOCALS) : {
+      FUSED_BINARY_OP(ARITHMETIC, -, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY_LOCALS) : {
+      FUSED_BINARY_OP(MULTIPLICATION, *, slots[OPERAND_AT(2)]);
+      DISPATCH();
     }
+    CASE(OP_DIVIDE_LOCALS) : {
+      FUSED_BINARY_OP(DIVISION, /, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_GREATER_LOCALS) : {
+      FUSED_BINARY_OP(COMPARISON, >, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_LESS_LOCALS) : {
+      FUSED_BINARY_OP(COMPARISON, <, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_ADD_LOCAL_CONSTANT) : {
+      FUSED_BINARY_OP(ARITHMETIC, +, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_SUBTRACT_LOCAL_CONSTANT) : {
+      FUSED_BINARY_OP(ARITHMETIC, -, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_MULTIPLY_LOCAL_CONSTANT) : {
+      FUSED_BINARY_OP(MULTIPLICATION, *, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_DIVIDE_LOCAL_CONSTANT) : {
+      FUSED_BINARY_OP(DIVISION, /, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_GREATER_LOCAL_CONSTANT) : {
+      FUSED_BINARY_OP(COMPARISON, >, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_LESS_LOCAL_CONSTANT) : {
+      FUSED_BINARY_OP(COMPARISON, <, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_LOCALS) : {
+      FUSED_COMPARE_JUMP(>, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_LOCALS) : {
+      FUSED_COMPARE_JUMP(>=, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_LOCALS) : {
+      FUSED_COMPARE_JUMP(<, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_LOCALS) : {
+      FUSED_COMPARE_JUMP(<=, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_LOCAL_CONSTANT) : {
+      FUSED_COMPARE_JUMP(>, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_GREATER_EQUAL_LOCAL_CONSTANT) : {
+      FUSED_COMPARE_JUMP(>=, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_LOCAL_CONSTANT) : {
+      FUSED_COMPARE_JUMP(<, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_EQUAL_LOCAL_CONSTANT) : {
+      FUSED_COMPARE_JUMP(<=, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_COPY_LOCAL) : {
+      // GET_LOCAL source SET_LOCAL destination POP
+      slots[OPERAND_AT(2)] = slots[OPERAND_AT(0)];
+      ip += 4;
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_CONSTANT) : {
+      // CONSTANT index SET_LOCAL destination POP
+      slots[OPERAND_AT(2)] = READ_CONSTANT_AT(0);
+      ip += 4;
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_ADD_LOCALS) : {
+      ASSIGN_BINARY_OP(ARITHMETIC, +, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_SUBTRACT_LOCALS) : {
+      ASSIGN_BINARY_OP(ARITHMETIC, -, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_MULTIPLY_LOCALS) : {
+      ASSIGN_BINARY_OP(MULTIPLICATION, *, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_DIVIDE_LOCALS) : {
+      ASSIGN_BINARY_OP(DIVISION, /, slots[OPERAND_AT(2)]);
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_ADD_LOCAL_CONSTANT) : {
+      ASSIGN_BINARY_OP(ARITHMETIC, +, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_SUBTRACT_LOCAL_CONSTANT) : {
+      ASSIGN_BINARY_OP(ARITHMETIC, -, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_MULTIPLY_LOCAL_CONSTANT) : {
+      ASSIGN_BINARY_OP(MULTIPLICATION, *, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_ASSIGN_DIVIDE_LOCAL_CONSTANT) : {
+      ASSIGN_BINARY_OP(DIVISION, /, READ_CONSTANT_AT(2));
+      DISPATCH();
+    }
+    CASE(OP_ADD_NUM) : {
+      Value b = PEEK(0);
+      Value a = PEEK(1);
+      if (!NUMBER_OP(PEEK(1), ARITHMETIC, a, +, b)) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      stack_top--;
+      DISPATCH();
+    }
+    CASE(OP_ADD_STR) : {
+      if (!IS_STRING(PEEK(0)) || !IS_STRING(PEEK(1))) {
+        DEOPTIMIZE(OP_ADD);
+      }
+      STORE_FRAME();
+      concatonate();
+      stack_top = vm.stack_top;
+      DISPATCH();
+    }
+    CASE(OP_GET_FIELD) : {
+      // GET_PROPERTY name slot, where slot is the bucket of the instance's
+      // fields the name was last found in.
+      if (!IS_INSTANCE(PEEK(0))) {
+        DEOPTIMIZE(OP_GET_PROPERTY);
+      }
+      Table *fields = &AS_INSTANCE(PEEK(0))->fields;
+      ObjString *name = AS_STRING(READ_CONSTANT_AT(0));
+      size_t slot = OPERAND_AT(1);
+      if (slot >= fields->capacity || fields->entries[slot].key != name) {
+        DEOPTIMIZE(OP_GET_PROPERTY);
+      }
+      PEEK(0) = fields->entries[slot].value;
+      ip += 2;
+      DISPATCH();
+    }
+    CASE(OP_CALL_CLOSURE) : {
+      size_t arg_count = OPERAND_AT(0);
+      if (!IS_CLOSURE(PEEK(arg_count))) {
+        DEOPTIMIZE(OP_CALL);
+      }
+      ip++;
+      STORE_FRAME();
+      if (!call(AS_CLOSURE(PEEK(arg_count)), arg_count)) {
+        UNWIND();
+      }
+      LOAD_FRAME();
+      DISPATCH();
+    }
+    CASE(OP_GET_ELEMENT_ARRAY) : {
+      if (!IS_ARRAY(PEEK(1)) || !IS_INT(PEEK(0))) {
+        DEOPTIMIZE(OP_GET_ELEMENT);
+      }
+      ObjArray *array = AS_ARRAY(PEEK(1));
+      int i = AS_INT(PEEK(0));
+      if (i < 0 || (size_t)i >= array->length) {
+        // Let the generic instruction report the error.
+        DEOPTIMIZE(OP_GET_ELEMENT);
+      }
+      STORE_FRAME();
+      Value value;
+      table_get(&array->values, int_to_string(i), &value);
+      DROP();
+      PEEK(0) = value;
+      DISPATCH();
     }
   }
 
-#undef READ_CONSTANT
+  // Only reached if the bytecode holds an unknown opcode.
+  RUNTIME_ERROR("Unknown opcode %d.", (int)ip[-1].operand);
+
+#undef STORE_FRAME
+#undef LOAD_FRAME
 #undef READ_BYTE
 #undef READ_SHORT
-#undef READ_STRING
+#undef READ_CONSTANT
+#undef OPERAND_CONSTANT
+#undef OPERAND_STRING
+#undef LONG_FORM
+#undef OPERAND_AT
+#undef READ_CONSTANT_AT
+#undef PUSH
+#undef POP
+#undef DROP
+#undef PEEK
+#undef UNWIND
+#undef RUNTIME_ERROR
+#undef ARITHMETIC_INT
+#undef ARITHMETIC_NUMBER
+#undef MULTIPLICATION_INT
+#undef MULTIPLICATION_NUMBER
+#undef DIVISION_INT
+#undef DIVISION_NUMBER
+#undef MODULO_INT
+#undef MODULO_NUMBER
+#undef FLOOR_DIVISION_INT
+#undef FLOOR_DIVISION_NUMBER
+#undef COMPARISON_INT
+#undef COMPARISON_NUMBER
+#undef NUMBER_OP
 #undef BINARY_OP
+#undef BITWISE_OP
+#undef COMPARE_JUMP
+#undef FUSED_BINARY_OP
+#undef FUSED_COMPARE_JUMP
+#undef FOR_LIMIT
+#undef ASSIGN_BINARY_OP
+#undef TRACE_INSTRUCTION
+#undef COUNT_INSTRUCTION
+#undef DEOPTIMIZE
+#undef IS_OPCODE
+#undef SET_OPCODE
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 /// Interprets the source code provided and executes it.
 ///
@@ -809,6 +2190,12 @@ InterpretResult interpret(const char *source) {
   ObjClosure *closure = new_closure(function);
   pop();
   push(OBJ_VAL(closure));
+#ifdef COMPUTED_GOTO
+  // call() decodes the script, which needs the handlers first.
+  if (opcode_handlers == NULL) {
+    run();
+  }
+#endif /* ifdef COMPUTED_GOTO */
   call(closure, 0);
 
   return run();
@@ -2,27 +2,47 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "intern.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include <stdint.h>
 
-#define FRAMES_MAX 64
+// The call stack and the value stack start out with room for this many
+// frames and values, and grow on demand.
+#define FRAMES_INITIAL 64
+#define STACK_INITIAL UINT8_COUNT
+// Default limits on the number of frames and values, which the
+// SALMON_FRAMES_MAX and SALMON_STACK_MAX environment variables override.
+#define FRAMES_MAX 65536
 #define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// An uncaught exception lists this many of the innermost frames and of the
+// outermost ones, and only counts the frames in between.
+#define TRACE_FRAMES_SHOWN 32
+// Values the VM itself pushes above a frame to keep objects it is building
+// reachable by the GC.
+#define STACK_TEMPORARIES 4
 
 typedef struct CallFrame {
   ObjClosure *closure;
-  uint8_t *ip;
+  Instruction *ip;
   Value *slots;
 } CallFrame;
 
 typedef struct VM {
-  CallFrame frames[FRAMES_MAX];
+  CallFrame *frames;
   size_t frame_count;
-  Value stack[STACK_MAX];
+  size_t frame_capacity;
+  size_t frames_max;
+  Value *stack;
   Value *stack_top;
+  size_t stack_capacity;
+  size_t stack_max;
   Table globals;
-  Table strings;
+  InternSet strings;
+  ValueArray symbols;
+  ValueArray index_strings;
+  uint64_t hash_seed;
   ObjString *init_string;
   ObjUpvalue *open_upvalues;
   size_t bytes_allocated;
@@ -31,7 +51,6 @@ typedef struct VM {
   size_t gray_count;
   size_t gray_capacity;
   Obj **gray_stack;
-  char *path;
 } VM;
 
 typedef enum InterpretResult {